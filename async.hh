@@ -0,0 +1,704 @@
+#ifndef ASYNC_HH
+#define ASYNC_HH
+
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <span>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "common.hh"
+#include "tcp.hh"
+#include "udp.hh"
+
+namespace jj
+{
+    template <typename T> class Task;
+
+    /*  Result storage shared by every Task promise, the continuation is the coroutine that co_awaits the task
+        and is resumed straight from final_suspend */
+    class PromiseBase
+    {
+        public:
+            std::coroutine_handle<> continuation = std::noop_coroutine();
+            std::exception_ptr error;
+
+            struct FinalAwaiter
+            {
+                auto await_ready() noexcept -> bool
+                {
+                    return false;
+                }
+
+                template <typename P> auto await_suspend(std::coroutine_handle<P> handle) noexcept
+                    -> std::coroutine_handle<>
+                {
+                    return handle.promise().continuation;
+                }
+
+                auto await_resume() noexcept -> void
+                {
+                }
+            };
+
+            auto initial_suspend() noexcept -> std::suspend_always
+            {
+                return {};
+            }
+
+            auto final_suspend() noexcept -> FinalAwaiter
+            {
+                return {};
+            }
+
+            auto unhandled_exception() -> void
+            {
+                error = std::current_exception();
+            }
+    };
+
+    template <typename T> class TaskPromise : public PromiseBase
+    {
+        public:
+            std::optional<T> value;
+
+            auto get_return_object() -> Task<T>;
+
+            template <typename U> auto return_value(U &&obj) -> void
+            {
+                value.emplace(std::forward<U>(obj));
+            }
+
+            auto result() -> T
+            {
+                if (error)
+                {
+                    std::rethrow_exception(error);
+                }
+                return std::move(*value);
+            }
+    };
+
+    template <> class TaskPromise<void> : public PromiseBase
+    {
+        public:
+            auto get_return_object() -> Task<void>;
+
+            auto return_void() -> void
+            {
+            }
+
+            auto result() -> void
+            {
+                if (error)
+                {
+                    std::rethrow_exception(error);
+                }
+            }
+    };
+
+    /*  A lazily started coroutine returning T. It only starts running when it is co_awaited, and the
+        awaiting coroutine continues as soon as it finishes, without going back through the event loop */
+    template <typename T = void> class Task
+    {
+        public:
+            using promise_type = TaskPromise<T>;
+
+        private:
+            std::coroutine_handle<promise_type> handle;
+
+        public:
+            explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle)
+            {
+            }
+
+            /* Destroys the coroutine frame */
+            ~Task()
+            {
+                if (handle)
+                {
+                    handle.destroy();
+                }
+            }
+
+            /* Task should not be copied, since this is undefined behavior */
+            Task(const Task &obj) = delete;
+
+            /* Task should not be copied, since this is undefined behavior */
+            auto operator=(const Task &obj) -> Task & = delete;
+
+            /* Task move constructor */
+            Task(Task &&obj) : handle(std::exchange(obj.handle, nullptr))
+            {
+            }
+
+            /* Task move assignment */
+            auto operator=(Task &&obj) -> Task &
+            {
+                if (this != &obj)
+                {
+                    if (handle)
+                    {
+                        handle.destroy();
+                    }
+                    handle = std::exchange(obj.handle, nullptr);
+                }
+                return *this;
+            }
+
+            /* Starts the task and suspends the caller until it has finished, giving its result */
+            auto operator co_await() && noexcept
+            {
+                struct Awaiter
+                {
+                    std::coroutine_handle<promise_type> handle;
+
+                    auto await_ready() noexcept -> bool
+                    {
+                        return false;
+                    }
+
+                    auto await_suspend(std::coroutine_handle<> caller) noexcept -> std::coroutine_handle<>
+                    {
+                        handle.promise().continuation = caller;
+                        return handle;
+                    }
+
+                    auto await_resume() -> T
+                    {
+                        return handle.promise().result();
+                    }
+                };
+                return Awaiter{handle};
+            }
+    };
+
+    template <typename T> inline auto TaskPromise<T>::get_return_object() -> Task<T>
+    {
+        return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+    }
+
+    inline auto TaskPromise<void>::get_return_object() -> Task<void>
+    {
+        return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+    }
+
+    /*  A single threaded edge triggered epoll loop that runs coroutines. Async operations try their syscall
+        first and only park the coroutine on the loop when it would block, so thousands of connections can
+        be written as straight line code on one thread */
+    class EventLoop
+    {
+        public:
+            /*  A parked async operation. attempt retries the syscall and returns false while it would still
+                block, once it returns true the coroutine in handle is resumed */
+            class Operation
+            {
+                public:
+                    int fd;
+                    std::uint32_t events;
+                    std::coroutine_handle<> handle;
+
+                    Operation(const int fd, const std::uint32_t events) : fd(fd), events(events)
+                    {
+                    }
+
+                    virtual ~Operation() = default;
+
+                    virtual auto attempt() -> bool = 0;
+
+                    auto await_ready() -> bool
+                    {
+                        return attempt();
+                    }
+
+                    auto await_suspend(std::coroutine_handle<> caller) -> void
+                    {
+                        handle = caller;
+                        EventLoop::current().wait(*this);
+                    }
+            };
+
+        private:
+            /* Owns a spawned task and tells the loop when it is done */
+            class Detached
+            {
+                public:
+                    class promise_type
+                    {
+                        public:
+                            EventLoop &loop;
+
+                            promise_type(EventLoop &loop, Task<void> &) : loop(loop)
+                            {
+                            }
+
+                            auto get_return_object() -> Detached
+                            {
+                                return {std::coroutine_handle<promise_type>::from_promise(*this)};
+                            }
+
+                            auto initial_suspend() noexcept -> std::suspend_always
+                            {
+                                return {};
+                            }
+
+                            auto final_suspend() noexcept -> std::suspend_never
+                            {
+                                loop.roots.erase(std::coroutine_handle<promise_type>::from_promise(*this).address());
+                                return {};
+                            }
+
+                            auto return_void() -> void
+                            {
+                            }
+
+                            auto unhandled_exception() -> void
+                            {
+                                if (!loop.error)
+                                {
+                                    loop.error = std::current_exception();
+                                }
+                            }
+                    };
+
+                    std::coroutine_handle<promise_type> handle;
+            };
+
+            struct Waiters
+            {
+                Operation *reader = nullptr;
+                Operation *writer = nullptr;
+            };
+
+            int epoll_fd;
+            int wake_fd;
+            std::atomic<bool> stopping = false;
+            std::unordered_map<int, Waiters> waiters;
+            std::unordered_set<void *> roots;
+            std::vector<std::coroutine_handle<>> runnable;
+            std::vector<struct epoll_event> ready;
+            std::exception_ptr error;
+
+            inline static thread_local EventLoop *running = nullptr;
+
+            static auto detach([[maybe_unused]] EventLoop &loop, Task<void> task) -> Detached
+            {
+                co_await std::move(task);
+            }
+
+            /* Resumes the operation parked in slot if its syscall now goes through */
+            auto complete(const int fd, Operation *Waiters::*slot) -> void
+            {
+                auto it = waiters.find(fd);
+                if (it == waiters.end() || it->second.*slot == nullptr || !(it->second.*slot)->attempt())
+                {
+                    return;
+                }
+                Operation *op = std::exchange(it->second.*slot, nullptr);
+                if (it->second.reader == nullptr && it->second.writer == nullptr)
+                {
+                    waiters.erase(it);
+                }
+                op->handle.resume();
+            }
+
+        public:
+            /* Create a new loop, max_events is the number of ready sockets handled per epoll_wait */
+            explicit EventLoop(const std::size_t max_events = 1024) : ready(max_events)
+            {
+                epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+                assert_throw(epoll_fd != -1, "Failed to create epoll instance");
+
+                wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (wake_fd == -1)
+                {
+                    close(epoll_fd);
+                }
+                assert_throw(wake_fd != -1, "Failed to create wakeup eventfd");
+
+                struct epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.fd = wake_fd;
+                int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+                if (ret == -1)
+                {
+                    close(wake_fd);
+                    close(epoll_fd);
+                }
+                assert_throw(ret != -1, "Failed to watch wakeup eventfd");
+            }
+
+            /* Destroys every task that has not finished yet and closes the epoll instance */
+            ~EventLoop()
+            {
+                std::vector<void *> unfinished(roots.begin(), roots.end());
+                roots.clear();
+                for (void *root : unfinished)
+                {
+                    std::coroutine_handle<>::from_address(root).destroy();
+                }
+                close(wake_fd);
+                close(epoll_fd);
+            }
+
+            /* EventLoop should not be copied, since this is undefined behavior */
+            EventLoop(const EventLoop &obj) = delete;
+
+            /* EventLoop should not be copied, since this is undefined behavior */
+            auto operator=(const EventLoop &obj) -> EventLoop & = delete;
+
+            /* The loop running on this thread, async operations can only be awaited from inside run */
+            static auto current() -> EventLoop &
+            {
+                assert_throw(running != nullptr, "No event loop is running on this thread");
+                return *running;
+            }
+
+            /* Hands task over to the loop, it starts on the next pass of run */
+            auto spawn(Task<void> task) -> void
+            {
+                Detached root = detach(*this, std::move(task));
+                roots.insert(root.handle.address());
+                runnable.push_back(root.handle);
+            }
+
+            /*  Parks op until its fd is ready. Sockets are added to epoll on every park, which is a no-op for
+                sockets already watched and picks up sockets that reused the fd of a closed one */
+            auto wait(Operation &op) -> void
+            {
+                Waiters &slot = waiters[op.fd];
+                Operation *&parked = (op.events & EPOLLOUT) ? slot.writer : slot.reader;
+                assert_throw(parked == nullptr, "Socket already has an operation waiting in that direction");
+
+                struct epoll_event ev = {};
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                ev.data.fd = op.fd;
+                int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, op.fd, &ev);
+                assert_throw(ret != -1 || errno == EEXIST, "Failed to register socket");
+                parked = &op;
+            }
+
+            /*  Runs spawned tasks until all of them have finished or stop is called. The first exception that
+                escapes a task is rethrown from here */
+            auto run() -> void
+            {
+                EventLoop *previous = std::exchange(running, this);
+                try
+                {
+                    while (!stopping.exchange(false))
+                    {
+                        for (std::size_t i = 0; i < runnable.size(); ++i)
+                        {
+                            runnable[i].resume();
+                        }
+                        runnable.clear();
+                        if (error)
+                        {
+                            std::rethrow_exception(std::exchange(error, nullptr));
+                        }
+                        if (roots.empty())
+                        {
+                            break;
+                        }
+
+                        int nready = epoll_wait(epoll_fd, ready.data(), ready.size(), -1);
+                        if (nready == -1 && errno == EINTR)
+                        {
+                            continue;
+                        }
+                        assert_throw(nready != -1, "Failed to wait for events");
+
+                        for (int i = 0; i < nready; ++i)
+                        {
+                            int fd = ready[i].data.fd;
+                            std::uint32_t events = ready[i].events;
+                            if (fd == wake_fd)
+                            {
+                                std::uint64_t count;
+                                [[maybe_unused]] ssize_t ret = ::read(wake_fd, &count, sizeof(count));
+                                continue;
+                            }
+                            if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                            {
+                                complete(fd, &Waiters::reader);
+                            }
+                            if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                            {
+                                complete(fd, &Waiters::writer);
+                            }
+                        }
+                        if (error)
+                        {
+                            std::rethrow_exception(std::exchange(error, nullptr));
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    running = previous;
+                    throw;
+                }
+                running = previous;
+            }
+
+            /* Makes run return after the current batch of events, safe to call from any thread */
+            auto stop() -> void
+            {
+                stopping = true;
+                std::uint64_t one = 1;
+                [[maybe_unused]] ssize_t ret = ::write(wake_fd, &one, sizeof(one));
+            }
+    };
+
+    class TCP::AsyncRead : public EventLoop::Operation
+    {
+        private:
+            TCP &tcp;
+            void *msg;
+            std::size_t size;
+            ssize_t nbytes = -1;
+            int err = 0;
+
+        public:
+            AsyncRead(TCP &tcp, void *msg, const std::size_t size)
+                : Operation(tcp.sock_fd, EPOLLIN), tcp(tcp), msg(msg), size(size)
+            {
+            }
+
+            auto attempt() -> bool override
+            {
+                do
+                {
+                    nbytes = tcp.stats.recv(size, [&] { return recv(fd, msg, size, MSG_DONTWAIT); });
+                } while (nbytes == -1 && errno == EINTR);
+                if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    return false;
+                }
+                err = nbytes == -1 ? errno : 0;
+                return true;
+            }
+
+            auto await_resume() -> std::size_t
+            {
+                assert_throw(err == 0, "Failed to read from socket");
+                return nbytes;
+            }
+    };
+
+    class TCP::AsyncWrite : public EventLoop::Operation
+    {
+        private:
+            TCP &tcp;
+            const char *msg;
+            std::size_t size;
+            std::size_t sent = 0;
+            int err = 0;
+
+        public:
+            AsyncWrite(TCP &tcp, const void *msg, const std::size_t size)
+                : Operation(tcp.sock_fd, EPOLLOUT), tcp(tcp), msg(static_cast<const char *>(msg)), size(size)
+            {
+            }
+
+            auto attempt() -> bool override
+            {
+                while (sent < size)
+                {
+                    std::size_t left = size - sent;
+                    ssize_t nbytes =
+                        tcp.stats.send(left, [&] { return send(fd, msg + sent, left, MSG_DONTWAIT | MSG_NOSIGNAL); });
+                    if (nbytes == -1)
+                    {
+                        if (errno == EINTR)
+                        {
+                            continue;
+                        }
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        {
+                            return false;
+                        }
+                        err = errno;
+                        return true;
+                    }
+                    sent += nbytes;
+                }
+                return true;
+            }
+
+            auto await_resume() -> std::size_t
+            {
+                assert_throw(err == 0, "Failed to write to socket");
+                return sent;
+            }
+    };
+
+    class TCP::AsyncAccept : public EventLoop::Operation
+    {
+        private:
+            TCP &listener;
+            int new_sock = -1;
+            struct sockaddr_storage peer;
+            std::exception_ptr error;
+
+        public:
+            explicit AsyncAccept(TCP &listener) : Operation(listener.sock_fd, EPOLLIN), listener(listener)
+            {
+                assert_throw(listener.side == Side::SERVER, "Must accept connection from server");
+            }
+
+            auto attempt() -> bool override
+            {
+                try
+                {
+                    new_sock = listener.accept_one(peer, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                    return true;
+                }
+                return new_sock != -1;
+            }
+
+            auto await_resume() -> TCP
+            {
+                if (error)
+                {
+                    std::rethrow_exception(error);
+                }
+                return TCP(new_sock, peer, true);
+            }
+    };
+
+    inline auto TCP::async_read(void *msg, const std::size_t size) -> AsyncRead
+    {
+        assert_throw(side != Side::SERVER, "Can not read from server socket");
+        return AsyncRead(*this, msg, size);
+    }
+
+    inline auto TCP::async_read(std::span<char> buf) -> AsyncRead
+    {
+        return async_read(buf.data(), buf.size());
+    }
+
+    inline auto TCP::async_write(const void *msg, const std::size_t size) -> AsyncWrite
+    {
+        assert_throw(side != Side::SERVER, "Can not write to server socket");
+        return AsyncWrite(*this, msg, size);
+    }
+
+    inline auto TCP::async_write(std::span<const char> buf) -> AsyncWrite
+    {
+        return async_write(buf.data(), buf.size());
+    }
+
+    inline auto TCP::async_accept() -> AsyncAccept
+    {
+        return AsyncAccept(*this);
+    }
+
+    class UDP::AsyncRecvFrom : public EventLoop::Operation
+    {
+        private:
+            UDP &udp;
+            void *msg;
+            std::size_t size;
+            ssize_t nbytes = -1;
+            int err = 0;
+
+        public:
+            AsyncRecvFrom(UDP &udp, void *msg, const std::size_t size)
+                : Operation(udp.sock_fd, EPOLLIN), udp(udp), msg(msg), size(size)
+            {
+            }
+
+            auto attempt() -> bool override
+            {
+                do
+                {
+                    nbytes = udp.recv_from_peer(msg, size, MSG_DONTWAIT);
+                } while (nbytes == -1 && errno == EINTR);
+                if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    return false;
+                }
+                err = nbytes == -1 ? errno : 0;
+                return true;
+            }
+
+            auto await_resume() -> std::size_t
+            {
+                assert_throw(err == 0, "Failed to read from socket");
+                return nbytes;
+            }
+    };
+
+    class UDP::AsyncSendTo : public EventLoop::Operation
+    {
+        private:
+            UDP &udp;
+            const void *msg;
+            std::size_t size;
+            ssize_t nbytes = -1;
+            int err = 0;
+
+        public:
+            AsyncSendTo(UDP &udp, const void *msg, const std::size_t size)
+                : Operation(udp.sock_fd, EPOLLOUT), udp(udp), msg(msg), size(size)
+            {
+            }
+
+            auto attempt() -> bool override
+            {
+                do
+                {
+                    nbytes = udp.send_to_peer(msg, size, MSG_DONTWAIT);
+                } while (nbytes == -1 && errno == EINTR);
+                if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    return false;
+                }
+                err = nbytes == -1 ? errno : 0;
+                return true;
+            }
+
+            auto await_resume() -> std::size_t
+            {
+                assert_throw(err == 0, "Failed to write to socket");
+                return nbytes;
+            }
+    };
+
+    inline auto UDP::async_recv_from(void *msg, const std::size_t size) -> AsyncRecvFrom
+    {
+        return AsyncRecvFrom(*this, msg, size);
+    }
+
+    inline auto UDP::async_recv_from(std::span<char> buf) -> AsyncRecvFrom
+    {
+        return async_recv_from(buf.data(), buf.size());
+    }
+
+    inline auto UDP::async_send_to(const void *msg, const std::size_t size) -> AsyncSendTo
+    {
+        return AsyncSendTo(*this, msg, size);
+    }
+
+    inline auto UDP::async_send_to(std::span<const char> buf) -> AsyncSendTo
+    {
+        return async_send_to(buf.data(), buf.size());
+    }
+} // namespace jj
+
+#endif
@@ -0,0 +1,632 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "endpoint.hh"
+#include "reactor.hh"
+#include "sharded.hh"
+#include "shm.hh"
+#include "tcp.hh"
+#include "udp.hh"
+
+/* The cpus this process may run on, in ascending order */
+auto allowed_cpus() -> std::vector<int>
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &set))
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/* Restricts the calling thread, and the threads it starts from now on, to cpus */
+auto pin_thread(const cpu_set_t &cpus) -> void
+{
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    jj::assert_throw(ret == 0, "Failed to set cpu affinity");
+}
+
+/*  Connects and disconnects as fast as possible on cpus until done is set, counting completed connects. Linger
+    is set to zero so the client side closes with a reset and never fills up the ephemeral ports with TIME_WAIT */
+auto connect_loop(const std::string port, std::atomic<bool> &done, std::atomic<std::size_t> &connects,
+                  const cpu_set_t cpus) -> void
+{
+    pin_thread(cpus);
+    struct linger no_linger = {1, 0};
+    while (!done.load(std::memory_order_relaxed))
+    {
+        jj::TCP client("127.0.0.1", port, jj::TCP::CLIENT);
+        setsockopt(client.fd(), SOL_SOCKET, SO_LINGER, &no_linger, sizeof(no_linger));
+        connects.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/*  Accepts per second of every shard with a given number of shards, the server closes every connection as soon
+    as it is accepted. Shard threads inherit the calling thread's cpus while the clients run on client_cpus, so
+    the load does not compete for the cores it is measuring */
+auto accept_rate(const std::string port, const std::size_t shards, const jj::ShardedServer::Steering steering,
+                 const std::size_t clients, const std::chrono::milliseconds duration, const cpu_set_t &client_cpus)
+    -> std::vector<double>
+{
+    std::vector<std::atomic<std::size_t>> accepted(shards);
+    jj::ShardedServer server(
+        port, [&](jj::Reactor &, jj::TCP &&, std::size_t shard) { accepted[shard].fetch_add(1); }, shards,
+        SOMAXCONN, steering);
+    server.start();
+
+    std::atomic<bool> done = false;
+    std::atomic<std::size_t> connects = 0;
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < clients; ++i)
+    {
+        threads.emplace_back(connect_loop, port, std::ref(done), std::ref(connects), client_cpus);
+    }
+
+    std::this_thread::sleep_for(duration / 10);
+    std::vector<std::size_t> start(shards);
+    for (std::size_t i = 0; i < shards; ++i)
+    {
+        start[i] = accepted[i].load();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(duration);
+    std::vector<double> rates(shards);
+    for (std::size_t i = 0; i < shards; ++i)
+    {
+        rates[i] = accepted[i].load() - start[i];
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+    done = true;
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    server.stop();
+    for (double &rate : rates)
+    {
+        rate /= elapsed.count();
+    }
+    return rates;
+}
+
+/* Runs op iterations times and returns the average nanoseconds per call */
+template <typename Op> auto ns_per_op(const std::size_t iterations, Op op) -> double
+{
+    auto begin = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        op();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / iterations;
+}
+
+/*  Cost of a read that would block through the expected based try_read against the throwing read. The socket
+    is made non-blocking behind the wrapper's back so read treats EAGAIN as an error and throws */
+auto error_paths(const std::string port, const std::size_t iterations) -> void
+{
+    jj::TCP server("", port, jj::TCP::SERVER);
+    jj::TCP client("127.0.0.1", port, jj::TCP::CLIENT);
+    jj::TCP conn = server.accept_connection();
+    fcntl(conn.fd(), F_SETFL, fcntl(conn.fd(), F_GETFL) | O_NONBLOCK);
+
+    char buf[64];
+    std::size_t failures = 0;
+    double expected = ns_per_op(iterations, [&] { failures += !conn.try_read(buf, sizeof(buf)).has_value(); });
+    double thrown = ns_per_op(iterations,
+                              [&]
+                              {
+                                  try
+                                  {
+                                      conn.read(buf, sizeof(buf));
+                                  }
+                                  catch (const std::runtime_error &)
+                                  {
+                                      ++failures;
+                                  }
+                              });
+
+    std::cout << "would-block read over " << iterations << " calls (" << failures << " failures)" << std::endl;
+    std::cout << "path\tns/op" << std::endl;
+    std::cout << "try_read\t" << expected << std::endl;
+    std::cout << "read+throw\t" << thrown << std::endl;
+}
+
+/* The p-th percentile (0 to 1) of samples, which gets sorted */
+auto percentile(std::vector<double> &samples, const double p) -> double
+{
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, static_cast<std::size_t>(p * samples.size()))];
+}
+
+/*  Microseconds from starting a connection to receiving the reply to its first 64 byte request, one new
+    connection per sample. The server allows fast open either way, fast_open only changes the client */
+auto first_response(jj::TCP &server, const std::string port, const bool fast_open, const std::size_t samples)
+    -> std::vector<double>
+{
+    jj::Reactor reactor;
+    reactor.add(std::move(server), jj::Reactor::READABLE,
+                [](jj::Reactor &reactor, jj::TCP &listener, std::uint32_t)
+                {
+                    std::vector<jj::TCP> conns;
+                    listener.accept_all(conns);
+                    for (jj::TCP &conn : conns)
+                    {
+                        reactor.add(std::move(conn), jj::Reactor::READABLE,
+                                    [](jj::Reactor &reactor, jj::TCP &conn, std::uint32_t)
+                                    {
+                                        char buf[64];
+                                        auto nbytes = conn.try_read(buf, sizeof(buf));
+                                        if (nbytes && *nbytes > 0)
+                                        {
+                                            conn.send_all(buf, *nbytes);
+                                        }
+                                        else if (nbytes.has_value() ||
+                                                 nbytes.error() != std::errc::resource_unavailable_try_again)
+                                        {
+                                            reactor.remove(conn);
+                                        }
+                                    });
+                    }
+                });
+    std::thread loop([&] { reactor.run(); });
+
+    std::vector<double> times;
+    char msg[64] = {};
+    struct linger no_linger = {1, 0};
+    for (std::size_t i = 0; i < samples; ++i)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        jj::TCP client("127.0.0.1", port, jj::TCP::CLIENT, jj::TCP::Options{.fast_open = fast_open});
+        client.send_all(msg, sizeof(msg));
+        client.recv_exact(msg, sizeof(msg));
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - begin;
+        times.push_back(elapsed.count());
+        setsockopt(client.fd(), SOL_SOCKET, SO_LINGER, &no_linger, sizeof(no_linger));
+    }
+
+    reactor.stop();
+    loop.join();
+    return times;
+}
+
+/* Time to first response with and without TCP Fast Open on the client */
+auto fast_open(const std::string port, const std::size_t samples) -> void
+{
+    std::cout << "time to first response over " << samples << " connections, in microseconds" << std::endl;
+    std::cout << "fastopen\tp50\tp99" << std::endl;
+    for (bool enabled : {false, true})
+    {
+        jj::TCP server("", port, jj::TCP::SERVER, jj::TCP::Options{.fast_open = 256});
+        std::vector<double> times = first_response(server, port, enabled, samples);
+        std::cout << (enabled ? "on" : "off") << "\t" << percentile(times, 0.5) << "\t" << percentile(times, 0.99)
+                  << std::endl;
+    }
+}
+
+/* Print results as one JSON object per line instead of a table, set by --json */
+bool json_output = false;
+
+/*  One measured run of the latency and throughput modes. Latencies are round trips for pingpong and one way
+    delivery times for the others, measured against the sender's steady_clock timestamp since both ends share
+    the host clock */
+struct Result
+{
+    std::string mode;
+    std::string transport;
+    std::size_t size = 0;
+    std::size_t connections = 1;
+    std::size_t messages = 0;
+    double seconds = 0;
+    std::vector<double> latency_us = {};
+};
+
+/* Prints the column names for report, unless the output is JSON */
+auto report_header() -> void
+{
+    if (!json_output)
+    {
+        std::cout << "mode\ttransport\tsize\tconns\tmsgs/s\tp50\tp99\tp99.9\tmax (us)" << std::endl;
+    }
+}
+
+/* Prints one run as a table row or a JSON object */
+auto report(Result &result) -> void
+{
+    std::vector<double> &lat = result.latency_us;
+    double rate = result.seconds > 0 ? result.messages / result.seconds : 0;
+    double p50 = lat.empty() ? 0 : percentile(lat, 0.5);
+    double p99 = lat.empty() ? 0 : percentile(lat, 0.99);
+    double p999 = lat.empty() ? 0 : percentile(lat, 0.999);
+    double max = lat.empty() ? 0 : lat.back();
+
+    if (json_output)
+    {
+        std::cout << "{\"mode\":\"" << result.mode << "\",\"transport\":\"" << result.transport
+                  << "\",\"size\":" << result.size << ",\"connections\":" << result.connections
+                  << ",\"messages\":" << result.messages << ",\"seconds\":" << result.seconds
+                  << ",\"msgs_per_s\":" << rate << ",\"p50_us\":" << p50 << ",\"p99_us\":" << p99
+                  << ",\"p999_us\":" << p999 << ",\"max_us\":" << max << "}" << std::endl;
+        return;
+    }
+    std::cout << result.mode << "\t" << result.transport << "\t" << result.size << "\t" << result.connections
+              << "\t" << static_cast<std::size_t>(rate) << "\t" << p50 << "\t" << p99 << "\t" << p999 << "\t" << max
+              << std::endl;
+}
+
+/* Nanoseconds on the steady clock, which every process on the host shares */
+auto now_ns() -> std::int64_t
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/* Stamps the first 8 bytes of msg with the current time, messages are never smaller than that */
+auto stamp(char *msg) -> void
+{
+    std::int64_t now = now_ns();
+    std::memcpy(msg, &now, sizeof(now));
+}
+
+/* Microseconds since msg was stamped */
+auto age_us(const char *msg) -> double
+{
+    std::int64_t sent;
+    std::memcpy(&sent, msg, sizeof(sent));
+    return (now_ns() - sent) / 1000.0;
+}
+
+/* Round trips of size byte messages over a TCP connection to endpoint, which can be a Unix socket */
+auto pingpong_tcp(const jj::Endpoint &endpoint, const std::string &transport, const std::size_t size,
+                  const std::size_t iterations) -> Result
+{
+    jj::TCP server(endpoint, jj::TCP::SERVER);
+    std::thread echo(
+        [&]
+        {
+            jj::TCP conn = server.accept_connection();
+            if (endpoint.family() != AF_UNIX)
+            {
+                conn.set_option<jj::sockopt::NoDelay>(true);
+            }
+            std::vector<char> buf(size);
+            for (std::size_t i = 0; i < iterations; ++i)
+            {
+                conn.recv_exact(buf.data(), size);
+                conn.send_all(buf.data(), size);
+            }
+        });
+
+    jj::TCP client(endpoint, jj::TCP::CLIENT);
+    if (endpoint.family() != AF_UNIX)
+    {
+        client.set_option<jj::sockopt::NoDelay>(true);
+    }
+    Result result{.mode = "pingpong", .transport = transport, .size = size};
+    result.latency_us.reserve(iterations);
+    std::vector<char> buf(size);
+    auto begin = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        std::int64_t sent = now_ns();
+        client.send_all(buf.data(), size);
+        client.recv_exact(buf.data(), size);
+        result.latency_us.push_back((now_ns() - sent) / 1000.0);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    result.messages = iterations;
+    echo.join();
+    return result;
+}
+
+/* Round trips of size byte messages through a shared memory channel */
+auto pingpong_shm(const std::size_t size, const std::size_t iterations) -> Result
+{
+    jj::Endpoint endpoint = jj::Endpoint::local("@jj-bench-shm");
+    jj::SHM server(endpoint, jj::SHM::SERVER);
+    std::thread echo(
+        [&]
+        {
+            jj::SHM conn = server.accept_connection();
+            for (std::size_t i = 0; i < iterations; ++i)
+            {
+                std::string_view msg = conn.read_frame();
+                conn.write_frame(msg.data(), msg.size());
+            }
+        });
+
+    jj::SHM client(endpoint, jj::SHM::CLIENT, jj::SHM::Options{.capacity = 4 * size});
+    Result result{.mode = "pingpong", .transport = "shm", .size = size};
+    result.latency_us.reserve(iterations);
+    std::vector<char> buf(size);
+    auto begin = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        std::int64_t sent = now_ns();
+        client.write_frame(buf.data(), size);
+        client.read_frame();
+        result.latency_us.push_back((now_ns() - sent) / 1000.0);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    result.messages = iterations;
+    echo.join();
+    return result;
+}
+
+/* Round trip latency at several payload sizes, over loopback TCP, a Unix socket and shared memory */
+auto pingpong(const std::string port, const std::size_t iterations) -> void
+{
+    report_header();
+    for (std::size_t size : {16, 256, 4096, 65536})
+    {
+        Result tcp = pingpong_tcp(jj::Endpoint("127.0.0.1", port), "tcp", size, iterations);
+        report(tcp);
+        Result local = pingpong_tcp(jj::Endpoint::local("@jj-bench-" + port), "unix", size, iterations);
+        report(local);
+        Result shm = pingpong_shm(size, iterations);
+        report(shm);
+    }
+}
+
+/*  Sends messages of size bytes from one connection per sender to a single Reactor thread, which records the
+    delivery time of each message. With one connection this is plain streaming throughput */
+auto fan_in(const std::string &mode, const std::string port, const std::size_t connections, const std::size_t size,
+            const std::size_t per_connection) -> Result
+{
+    Result result{.mode = mode, .transport = "tcp", .size = size, .connections = connections};
+    result.latency_us.reserve(connections * per_connection);
+    std::size_t expected = connections * per_connection;
+
+    jj::Reactor reactor;
+    reactor.add(jj::TCP("127.0.0.1", port, jj::TCP::SERVER), jj::Reactor::READABLE,
+                [&](jj::Reactor &reactor, jj::TCP &listener, std::uint32_t)
+                {
+                    std::vector<jj::TCP> conns;
+                    listener.accept_all(conns);
+                    for (jj::TCP &conn : conns)
+                    {
+                        reactor.add(std::move(conn), jj::Reactor::READABLE,
+                                    [&, buf = std::vector<char>(std::max<std::size_t>(size, 64 << 10)),
+                                     held = std::size_t{0}](jj::Reactor &reactor, jj::TCP &conn, std::uint32_t) mutable
+                                    {
+                                        while (true)
+                                        {
+                                            auto nbytes = conn.try_read(buf.data() + held, buf.size() - held);
+                                            if (!nbytes || *nbytes == 0)
+                                            {
+                                                bool drained = !nbytes && nbytes.error() ==
+                                                                              std::errc::resource_unavailable_try_again;
+                                                if (!drained)
+                                                {
+                                                    reactor.remove(conn);
+                                                }
+                                                return;
+                                            }
+                                            held += *nbytes;
+                                            std::size_t used = 0;
+                                            for (; held - used >= size; used += size)
+                                            {
+                                                result.latency_us.push_back(age_us(buf.data() + used));
+                                            }
+                                            std::memmove(buf.data(), buf.data() + used, held - used);
+                                            held -= used;
+                                            if (result.latency_us.size() == expected)
+                                            {
+                                                reactor.stop();
+                                            }
+                                        }
+                                    });
+                    }
+                });
+
+    std::vector<std::thread> senders;
+    auto begin = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < connections; ++i)
+    {
+        senders.emplace_back(
+            [&]
+            {
+                jj::TCP client("127.0.0.1", port, jj::TCP::CLIENT);
+                std::vector<char> msg(size);
+                for (std::size_t n = 0; n < per_connection; ++n)
+                {
+                    stamp(msg.data());
+                    client.send_all(msg.data(), size);
+                }
+                client.flush();
+            });
+    }
+    reactor.run();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    result.messages = result.latency_us.size();
+    for (std::thread &sender : senders)
+    {
+        sender.join();
+    }
+    return result;
+}
+
+/*  Datagrams of size bytes sent as fast as possible, messages/s counts the ones that arrived and the loss
+    shows up as messages below the number sent */
+auto udp_rate(const std::string port, const std::size_t size, const std::size_t packets) -> Result
+{
+    Result result{.mode = "udp", .transport = "udp", .size = size};
+    result.latency_us.reserve(packets);
+
+    jj::UDP server("127.0.0.1", port, jj::UDP::SERVER);
+    server.set_option<jj::sockopt::RecvBuffer>(8 << 20);
+    std::chrono::steady_clock::time_point first, last;
+    std::thread receiver(
+        [&]
+        {
+            std::vector<char> buf(size);
+            struct pollfd pfd = {server.fd(), POLLIN, 0};
+            while (result.latency_us.size() < packets && poll(&pfd, 1, 500) == 1)
+            {
+                auto nbytes = server.try_read(buf.data(), buf.size());
+                if (nbytes && *nbytes == size)
+                {
+                    last = std::chrono::steady_clock::now();
+                    if (result.latency_us.empty())
+                    {
+                        first = last;
+                    }
+                    result.latency_us.push_back(age_us(buf.data()));
+                }
+            }
+        });
+
+    jj::UDP client("127.0.0.1", port, jj::UDP::CLIENT);
+    std::vector<char> msg(size);
+    for (std::size_t i = 0; i < packets; ++i)
+    {
+        stamp(msg.data());
+        client.try_write(msg.data(), size);
+    }
+    receiver.join();
+    result.seconds = std::chrono::duration<double>(last - first).count();
+    result.messages = result.latency_us.size();
+    return result;
+}
+
+auto usage() -> int
+{
+    std::cout << "bench accept [port] [max shards] [ms per run] [cpu]" << std::endl;
+    std::cout << "bench errors [port] [iterations]" << std::endl;
+    std::cout << "bench fastopen [port] [connections]" << std::endl;
+    std::cout << "bench pingpong [port] [round trips per size] [--json]" << std::endl;
+    std::cout << "bench stream [port] [megabytes per size] [--json]" << std::endl;
+    std::cout << "bench fanin [port] [connections] [messages per connection] [--json]" << std::endl;
+    std::cout << "bench udp [port] [packets per size] [--json]" << std::endl;
+    return EXIT_FAILURE;
+}
+
+auto main(int argc, char **argv) -> int
+{
+    std::vector<std::string> args(argv, argv + argc);
+    auto json = std::find(args.begin(), args.end(), "--json");
+    if (json != args.end())
+    {
+        json_output = true;
+        args.erase(json);
+    }
+    argc = args.size();
+
+    if (argc < 2)
+    {
+        return usage();
+    }
+    std::string mode = args[1];
+    std::string port = argc > 2 ? args[2] : "5001";
+
+    if (mode == "accept")
+    {
+        /* The first max_shards allowed cpus run the shards and the rest run the clients */
+        std::vector<int> cpus = allowed_cpus();
+        std::size_t max_shards = argc > 3 ? std::stoul(args[3]) : std::max<std::size_t>(cpus.size() / 2, 1);
+        std::chrono::milliseconds duration(argc > 4 ? std::stoul(args[4]) : 2000);
+        jj::ShardedServer::Steering steering =
+            argc > 5 && args[5] == "cpu" ? jj::ShardedServer::CPU : jj::ShardedServer::HASH;
+
+        cpu_set_t server_cpus;
+        cpu_set_t client_cpus;
+        CPU_ZERO(&server_cpus);
+        CPU_ZERO(&client_cpus);
+        for (std::size_t i = 0; i < cpus.size(); ++i)
+        {
+            CPU_SET(cpus[i], i < max_shards || cpus.size() <= max_shards ? &server_cpus : &client_cpus);
+        }
+        if (cpus.size() <= max_shards)
+        {
+            std::cout << "only " << cpus.size() << " cpus for " << max_shards
+                      << " shards, the clients share them with the shards" << std::endl;
+            client_cpus = server_cpus;
+        }
+        pin_thread(server_cpus);
+
+        std::cout << "accept scaling on 127.0.0.1:" << port
+                  << (steering == jj::ShardedServer::CPU ? " with" : " without") << " cpu steering" << std::endl;
+        std::cout << "shards\taccepts/s\tper shard" << std::endl;
+        for (std::size_t shards = 1; shards <= max_shards; shards *= 2)
+        {
+            std::vector<double> rates = accept_rate(port, shards, steering, 2 * max_shards, duration, client_cpus);
+            double total = 0;
+            for (double rate : rates)
+            {
+                total += rate;
+            }
+            std::cout << shards << "\t" << static_cast<std::size_t>(total) << "\t";
+            for (std::size_t i = 0; i < rates.size(); ++i)
+            {
+                std::cout << (i == 0 ? "" : " ") << static_cast<std::size_t>(rates[i]);
+            }
+            std::cout << std::endl;
+        }
+    }
+    else if (mode == "errors")
+    {
+        error_paths(port, argc > 3 ? std::stoul(args[3]) : 1000000);
+    }
+    else if (mode == "fastopen")
+    {
+        fast_open(port, argc > 3 ? std::stoul(args[3]) : 10000);
+    }
+    else if (mode == "pingpong")
+    {
+        pingpong(port, argc > 3 ? std::stoul(args[3]) : 100000);
+    }
+    else if (mode == "stream")
+    {
+        std::size_t bytes = (argc > 3 ? std::stoul(args[3]) : 256) << 20;
+        report_header();
+        for (std::size_t size : {64, 1024, 16384, 65536})
+        {
+            Result result = fan_in("stream", port, 1, size, bytes / size);
+            report(result);
+        }
+    }
+    else if (mode == "fanin")
+    {
+        std::size_t connections = argc > 3 ? std::stoul(args[3]) : 32;
+        Result result = fan_in("fanin", port, connections, 64, argc > 4 ? std::stoul(args[4]) : 100000);
+        report_header();
+        report(result);
+    }
+    else if (mode == "udp")
+    {
+        std::size_t packets = argc > 3 ? std::stoul(args[3]) : 1000000;
+        report_header();
+        for (std::size_t size : {64, 512, 1400})
+        {
+            Result result = udp_rate(port, size, packets);
+            report(result);
+        }
+    }
+    else
+    {
+        return usage();
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 #include <string>
 
@@ -8,17 +9,27 @@ auto main(int argc, char** argv) -> int
     if (argc != 2)
     {
         std::cout << "Pass in the server IP" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    jj::UDP client("0.0.0.0", "5000", jj::UDP::CLIENT);
+    jj::UDP client(argv[1], "5000", jj::UDP::CLIENT);
+    /* A lost request or reply would otherwise leave the loop waiting forever */
+    client.set_timeout(std::chrono::seconds(1));
     std::string msg;
 
-    while (true)
+    while (std::getline(std::cin, msg))
     {
-        std::getline(std::cin, msg);
         client << msg;
-        client >> msg;
-        std::cout << msg << std::endl;
+        msg.resize(1024);
+        try
+        {
+            client >> msg;
+            std::cout << msg.c_str() << std::endl;
+        }
+        catch (const jj::TimeoutError &)
+        {
+            std::cout << "No reply from server" << std::endl;
+        }
     }
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,71 @@
+#ifndef COMMON_HH
+#define COMMON_HH
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace jj
+{
+    /* Helper to use assert like syntax to throw an error */
+    inline auto assert_throw(bool condition, const std::string &msg) -> void
+    {
+        if (condition == false)
+        {
+            throw std::runtime_error(msg);
+        }
+    }
+
+    /*  Thrown when a read or write runs past its deadline or the socket's timeout. The connection is still
+        open, but a stream may have been left part way through a message */
+    class TimeoutError : public std::runtime_error
+    {
+        public:
+            using std::runtime_error::runtime_error;
+    };
+
+    /* The deadline of calls that wait for as long as it takes */
+    inline constexpr std::chrono::steady_clock::time_point NO_DEADLINE = std::chrono::steady_clock::time_point::max();
+
+    /*  Waits until fd is ready for events or deadline passes. Returns false with errno set to ETIMEDOUT once
+        the deadline has passed, or to what poll failed with. An interrupted wait counts as ready, so callers
+        just retry their syscall */
+    inline auto wait_fd(const int fd, const short events, const std::chrono::steady_clock::time_point deadline)
+        -> bool
+    {
+        int timeout = -1;
+        if (deadline != NO_DEADLINE)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (deadline <= now)
+            {
+                errno = ETIMEDOUT;
+                return false;
+            }
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - now);
+            timeout = std::min<std::chrono::milliseconds::rep>(left.count(), INT_MAX);
+        }
+        struct pollfd pfd = {fd, events, 0};
+        int ret = poll(&pfd, 1, timeout);
+        if (ret == 0)
+        {
+            errno = ETIMEDOUT;
+            return false;
+        }
+        return ret != -1 || errno == EINTR;
+    }
+
+    /* Helper to load a string into a vector */
+    inline auto operator<<(std::vector<char> &vec, const std::string str) -> std::vector<char> &
+    {
+        std::copy(str.begin(), str.end() + 1, vec.begin());
+        return vec;
+    }
+} // namespace jj
+
+#endif
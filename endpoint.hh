@@ -0,0 +1,288 @@
+#ifndef ENDPOINT_HH
+#define ENDPOINT_HH
+
+#include <arpa/inet.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.hh"
+
+namespace jj
+{
+    /*  An IPv4 or IPv6 address and port, or a Unix domain socket path, parsed once into the sockaddr the
+        kernel wants so it can be stored and passed to connect, bind and sendto over and over without touching
+        strings again */
+    class Endpoint
+    {
+        private:
+            struct sockaddr_storage addr = {};
+            socklen_t addr_len = 0;
+
+            static auto parse_port(const std::string &port) -> std::uint16_t
+            {
+                std::size_t used = 0;
+                unsigned long value = 0;
+                try
+                {
+                    value = std::stoul(port, &used);
+                }
+                catch (const std::exception &)
+                {
+                    used = 0;
+                }
+                assert_throw(used == port.size() && used != 0 && value <= 65535, "Invalid port: " + port);
+                return value;
+            }
+
+        public:
+            /* An empty endpoint, only useful as something to assign to */
+            Endpoint() = default;
+
+            /*  Parses a numeric IPv4 ("127.0.0.1") or IPv6 ("::1", "[::1]", "fe80::1%eth0") address. An empty
+                ip_addr is the IPv4 wildcard 0.0.0.0, use "::" for a dual-stack wildcard */
+            Endpoint(const std::string &ip_addr, const std::string &port)
+            {
+                std::uint16_t port_num = htons(parse_port(port));
+                std::string ip = ip_addr.empty() ? "0.0.0.0" : ip_addr;
+                if (ip.size() > 2 && ip.front() == '[' && ip.back() == ']')
+                {
+                    ip = ip.substr(1, ip.size() - 2);
+                }
+
+                struct sockaddr_in v4 = {};
+                if (inet_pton(AF_INET, ip.c_str(), &v4.sin_addr) == 1)
+                {
+                    v4.sin_family = AF_INET;
+                    v4.sin_port = port_num;
+                    std::memcpy(&addr, &v4, sizeof(v4));
+                    addr_len = sizeof(v4);
+                    return;
+                }
+
+                struct sockaddr_in6 v6 = {};
+                std::string::size_type scope = ip.find('%');
+                if (scope != std::string::npos)
+                {
+                    v6.sin6_scope_id = if_nametoindex(ip.c_str() + scope + 1);
+                    assert_throw(v6.sin6_scope_id != 0, "Unknown interface in address: " + ip_addr);
+                    ip.resize(scope);
+                }
+                assert_throw(inet_pton(AF_INET6, ip.c_str(), &v6.sin6_addr) == 1, "Invalid IP address: " + ip_addr);
+                v6.sin6_family = AF_INET6;
+                v6.sin6_port = port_num;
+                std::memcpy(&addr, &v6, sizeof(v6));
+                addr_len = sizeof(v6);
+            }
+
+            /* Copies an address the kernel handed back, e.g. from accept or recvfrom */
+            Endpoint(const struct sockaddr *sa, const socklen_t len)
+            {
+                assert_throw(len <= sizeof(addr), "Address is too large");
+                std::memcpy(&addr, sa, len);
+                addr_len = len;
+            }
+
+            /*  A Unix domain socket at path, or in the abstract namespace when path starts with '@'. Abstract
+                sockets have no file and disappear with the last socket using them */
+            static auto local(const std::string &path) -> Endpoint
+            {
+                struct sockaddr_un un = {};
+                assert_throw(!path.empty() && path.size() < sizeof(un.sun_path), "Invalid Unix socket path: " + path);
+                un.sun_family = AF_UNIX;
+                std::memcpy(un.sun_path, path.data(), path.size());
+                socklen_t len = offsetof(struct sockaddr_un, sun_path) + path.size();
+                if (path.front() == '@')
+                {
+                    un.sun_path[0] = '\0';
+                }
+                else
+                {
+                    ++len;
+                }
+                return Endpoint(reinterpret_cast<const struct sockaddr *>(&un), len);
+            }
+
+            /*  Looks up host with DNS or /etc/hosts, preferring whatever order the resolver returns. Blocking,
+                so resolve once up front and keep the result */
+            static auto resolve(const std::string &host, const std::string &port) -> Endpoint
+            {
+                struct addrinfo hints = {};
+                hints.ai_family = AF_UNSPEC;
+                hints.ai_flags = AI_ADDRCONFIG;
+                struct addrinfo *results = nullptr;
+                int ret = getaddrinfo(host.c_str(), nullptr, &hints, &results);
+                assert_throw(ret == 0 && results != nullptr, "Failed to resolve " + host);
+
+                Endpoint endpoint(results->ai_addr, results->ai_addrlen);
+                freeaddrinfo(results);
+                endpoint.set_port(parse_port(port));
+                return endpoint;
+            }
+
+            /* AF_INET, AF_INET6 or AF_UNIX, AF_UNSPEC for an empty endpoint */
+            auto family() const -> int
+            {
+                return addr.ss_family;
+            }
+
+            /* The address for passing to connect, bind or sendto */
+            auto data() const -> const struct sockaddr *
+            {
+                return reinterpret_cast<const struct sockaddr *>(&addr);
+            }
+
+            /* The length for passing to connect, bind or sendto */
+            auto size() const -> socklen_t
+            {
+                return addr_len;
+            }
+
+            /* The port in host byte order, 0 for Unix sockets */
+            auto port() const -> std::uint16_t
+            {
+                if (family() == AF_INET6)
+                {
+                    return ntohs(reinterpret_cast<const struct sockaddr_in6 *>(&addr)->sin6_port);
+                }
+                if (family() == AF_INET)
+                {
+                    return ntohs(reinterpret_cast<const struct sockaddr_in *>(&addr)->sin_port);
+                }
+                return 0;
+            }
+
+            /* Changes the port, given in host byte order */
+            auto set_port(const std::uint16_t port) -> void
+            {
+                if (family() == AF_INET6)
+                {
+                    reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_port = htons(port);
+                }
+                else if (family() == AF_INET)
+                {
+                    reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port = htons(port);
+                }
+            }
+
+            /*  The address without the port, e.g. "127.0.0.1" or "::1". Unix sockets give their path, with a
+                leading '@' in the abstract namespace, and an empty string when unnamed */
+            auto address() const -> std::string
+            {
+                if (family() == AF_UNIX)
+                {
+                    const struct sockaddr_un *un = reinterpret_cast<const struct sockaddr_un *>(&addr);
+                    std::size_t len = addr_len - offsetof(struct sockaddr_un, sun_path);
+                    if (len == 0)
+                    {
+                        return "";
+                    }
+                    if (un->sun_path[0] == '\0')
+                    {
+                        return "@" + std::string(un->sun_path + 1, len - 1);
+                    }
+                    return std::string(un->sun_path, strnlen(un->sun_path, len));
+                }
+
+                char buf[INET6_ADDRSTRLEN] = {};
+                if (family() == AF_INET6)
+                {
+                    inet_ntop(AF_INET6, &reinterpret_cast<const struct sockaddr_in6 *>(&addr)->sin6_addr, buf,
+                              sizeof(buf));
+                }
+                else if (family() == AF_INET)
+                {
+                    inet_ntop(AF_INET, &reinterpret_cast<const struct sockaddr_in *>(&addr)->sin_addr, buf,
+                              sizeof(buf));
+                }
+                return buf;
+            }
+
+            /* "address:port", with the address in brackets for IPv6, just the path for Unix sockets */
+            auto to_string() const -> std::string
+            {
+                if (family() == AF_UNIX)
+                {
+                    return address();
+                }
+                if (family() == AF_INET6)
+                {
+                    return "[" + address() + "]:" + std::to_string(port());
+                }
+                return address() + ":" + std::to_string(port());
+            }
+
+            /* Whether this is the IPv6 wildcard "::", which dual-stack sockets bind to */
+            auto is_v6_any() const -> bool
+            {
+                return family() == AF_INET6 &&
+                       IN6_IS_ADDR_UNSPECIFIED(&reinterpret_cast<const struct sockaddr_in6 *>(&addr)->sin6_addr);
+            }
+
+            /*  The same endpoint in the form a socket of the given family can send to, an IPv4 endpoint becomes
+                ::ffff:a.b.c.d for IPv6 sockets */
+            auto for_family(const int socket_family) const -> Endpoint
+            {
+                if (socket_family != AF_INET6 || family() != AF_INET)
+                {
+                    return *this;
+                }
+                const struct sockaddr_in *v4 = reinterpret_cast<const struct sockaddr_in *>(&addr);
+                struct sockaddr_in6 v6 = {};
+                v6.sin6_family = AF_INET6;
+                v6.sin6_port = v4->sin_port;
+                v6.sin6_addr.s6_addr[10] = 0xff;
+                v6.sin6_addr.s6_addr[11] = 0xff;
+                std::memcpy(&v6.sin6_addr.s6_addr[12], &v4->sin_addr, sizeof(v4->sin_addr));
+                return Endpoint(reinterpret_cast<const struct sockaddr *>(&v6), sizeof(v6));
+            }
+
+            /*  Removes the file of a Unix socket bound to a path, if it is still a socket. Servers do this before
+                binding, to clear the leftovers of a previous run, and when they are destroyed */
+            auto unlink_socket() const -> void
+            {
+                if (family() != AF_UNIX || addr_len <= offsetof(struct sockaddr_un, sun_path))
+                {
+                    return;
+                }
+                const struct sockaddr_un *un = reinterpret_cast<const struct sockaddr_un *>(&addr);
+                struct stat st;
+                if (un->sun_path[0] != '\0' && stat(un->sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+                {
+                    unlink(un->sun_path);
+                }
+            }
+
+            friend auto operator==(const Endpoint &lhs, const Endpoint &rhs) -> bool
+            {
+                return lhs.addr_len == rhs.addr_len && std::memcmp(&lhs.addr, &rhs.addr, lhs.addr_len) == 0;
+            }
+
+            /* Hashes the same bytes operator== compares, so endpoints can key unordered containers */
+            auto hash() const -> std::size_t
+            {
+                return std::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char *>(&addr), addr_len));
+            }
+    };
+} // namespace jj
+
+template <> struct std::hash<jj::Endpoint>
+{
+    auto operator()(const jj::Endpoint &endpoint) const -> std::size_t
+    {
+        return endpoint.hash();
+    }
+};
+
+#endif
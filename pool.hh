@@ -0,0 +1,350 @@
+#ifndef POOL_HH
+#define POOL_HH
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "common.hh"
+#include "endpoint.hh"
+#include "tcp.hh"
+
+namespace jj
+{
+    /*  Keeps connected TCP clients around between requests so they skip the handshake and slow start. Idle
+        connections are kept per endpoint, keyed by the parsed address so "::1" and "[::1]" share them. At most
+        max_per_endpoint connections to one endpoint exist at a time and connections idle for longer than
+        max_idle are closed. Endpoints are spread over independently
+        locked shards, and connecting and health checks happen outside the locks, so many threads can use one
+        pool without queueing behind each other. */
+    class ConnectionPool
+    {
+        public:
+            using Clock = std::chrono::steady_clock;
+
+            /*  A checked out connection, it goes back to the pool when the lease is destroyed. Call discard if
+                the connection is in an unknown state, e.g. after an exception halfway through a request */
+            class Lease
+            {
+                    friend class ConnectionPool;
+
+                private:
+                    ConnectionPool *pool = nullptr;
+                    Endpoint key;
+                    std::optional<TCP> tcp;
+
+                    Lease(ConnectionPool *pool, const Endpoint &key, TCP &&tcp)
+                        : pool(pool), key(key), tcp(std::move(tcp))
+                    {
+                    }
+
+                public:
+                    /* Returns the connection to the pool */
+                    ~Lease()
+                    {
+                        if (tcp)
+                        {
+                            pool->give_back(key, std::move(*tcp));
+                        }
+                    }
+
+                    /* Lease should not be copied, since this is undefined behavior */
+                    Lease(const Lease &obj) = delete;
+
+                    /* Lease should not be copied, since this is undefined behavior */
+                    auto operator=(const Lease &obj) -> Lease & = delete;
+
+                    /* Lease move constructor */
+                    Lease(Lease &&obj) : pool(obj.pool), key(obj.key), tcp(std::move(obj.tcp))
+                    {
+                        obj.tcp.reset();
+                    }
+
+                    /* Lease move assignment, returns the connection currently held first */
+                    auto operator=(Lease &&obj) -> Lease &
+                    {
+                        if (this == &obj)
+                        {
+                            return *this;
+                        }
+                        if (tcp)
+                        {
+                            pool->give_back(key, std::move(*tcp));
+                        }
+                        pool = obj.pool;
+                        key = obj.key;
+                        tcp = std::move(obj.tcp);
+                        obj.tcp.reset();
+                        return *this;
+                    }
+
+                    auto operator*() -> TCP &
+                    {
+                        return *tcp;
+                    }
+
+                    auto operator->() -> TCP *
+                    {
+                        return &*tcp;
+                    }
+
+                    /* Closes the connection instead of returning it, freeing its slot for a new one */
+                    auto discard() -> void
+                    {
+                        if (tcp)
+                        {
+                            tcp.reset();
+                            pool->release(key);
+                        }
+                    }
+            };
+
+        private:
+            struct Idle
+            {
+                TCP tcp;
+                Clock::time_point since;
+            };
+
+            /* The connections to one endpoint */
+            struct Slot
+            {
+                /* Oldest first, checkouts take the newest since it is the most likely to still be alive */
+                std::vector<Idle> idle;
+                std::size_t open = 0;
+
+                /*  Signalled when a connection comes back or a slot frees up. One per endpoint so a wakeup always
+                    goes to a checkout that can use it */
+                std::condition_variable freed;
+            };
+
+            struct Shard
+            {
+                std::mutex mutex;
+                std::unordered_map<Endpoint, Slot> slots;
+            };
+
+            std::vector<std::unique_ptr<Shard>> shards;
+            std::size_t max_per_endpoint;
+            Clock::duration max_idle;
+
+            auto shard_for(const Endpoint &key) -> Shard &
+            {
+                return *shards[key.hash() % shards.size()];
+            }
+
+            /*  Moves idle connections older than max_idle from the front of slot into expired, the caller holds
+                the lock and destroys expired after letting go of it, so closing never happens under it */
+            auto expire(Slot &slot, const Clock::time_point now, std::vector<Idle> &expired) -> std::size_t
+            {
+                std::size_t stale = 0;
+                while (stale < slot.idle.size() && now - slot.idle[stale].since >= max_idle)
+                {
+                    ++stale;
+                }
+                std::move(slot.idle.begin(), slot.idle.begin() + stale, std::back_inserter(expired));
+                slot.idle.erase(slot.idle.begin(), slot.idle.begin() + stale);
+                slot.open -= stale;
+                return stale;
+            }
+
+            /*  An idle connection is healthy if nothing is waiting to be read, readable means the peer closed it
+                or sent data nobody asked for, both of which make it unusable for the next request */
+            static auto healthy(const TCP &tcp) -> bool
+            {
+                struct pollfd pfd = {tcp.fd(), POLLIN, 0};
+                return poll(&pfd, 1, 0) == 0;
+            }
+
+            /* Frees the slot of a connection that was closed instead of returned */
+            auto release(const Endpoint &key) -> void
+            {
+                Shard &shard = shard_for(key);
+                Slot *slot;
+                {
+                    std::lock_guard lock(shard.mutex);
+                    slot = &shard.slots[key];
+                    --slot->open;
+                }
+                slot->freed.notify_one();
+            }
+
+            /* Puts a leased connection back, anything still buffered is sent first */
+            auto give_back(const Endpoint &key, TCP &&tcp) -> void
+            {
+                try
+                {
+                    tcp.flush();
+                }
+                catch (const std::runtime_error &)
+                {
+                    release(key);
+                    return;
+                }
+
+                Shard &shard = shard_for(key);
+                Slot *slot;
+                std::vector<Idle> expired;
+                {
+                    std::lock_guard lock(shard.mutex);
+                    slot = &shard.slots[key];
+                    Clock::time_point now = Clock::now();
+                    expire(*slot, now, expired);
+                    slot->idle.push_back(Idle{std::move(tcp), now});
+                }
+                slot->freed.notify_one();
+            }
+
+        public:
+            /*  Create a new pool, at most max_per_endpoint connections to one endpoint are open at once and idle
+                connections are closed after max_idle. shard_count is the number of independently locked
+                groups of endpoints */
+            explicit ConnectionPool(const std::size_t max_per_endpoint = 64,
+                                    const Clock::duration max_idle = std::chrono::seconds(60),
+                                    const std::size_t shard_count = 16)
+                : max_per_endpoint(max_per_endpoint), max_idle(max_idle)
+            {
+                assert_throw(max_per_endpoint > 0 && shard_count > 0, "Pool limits must be non zero");
+                for (std::size_t i = 0; i < shard_count; ++i)
+                {
+                    shards.push_back(std::make_unique<Shard>());
+                }
+            }
+
+            /* ConnectionPool should not be copied, since this is undefined behavior */
+            ConnectionPool(const ConnectionPool &obj) = delete;
+
+            /* ConnectionPool should not be copied, since this is undefined behavior */
+            auto operator=(const ConnectionPool &obj) -> ConnectionPool & = delete;
+
+            /*  Hands out a connection to ip_addr:port, reusing the newest healthy idle one or connecting a new
+                one. When max_per_endpoint connections are already checked out it waits up to timeout for one
+                to come back and throws if none does. Leases must not outlive the pool */
+            auto checkout(const std::string &ip_addr, const std::string &port,
+                          const Clock::duration timeout = Clock::duration::max()) -> Lease
+            {
+                return checkout(Endpoint(ip_addr, port), timeout);
+            }
+
+            /* Same as above for a parsed endpoint, which skips parsing the address on every checkout */
+            auto checkout(const Endpoint &key, const Clock::duration timeout = Clock::duration::max()) -> Lease
+            {
+                Shard &shard = shard_for(key);
+                Clock::time_point deadline =
+                    timeout == Clock::duration::max() ? Clock::time_point::max() : Clock::now() + timeout;
+
+                while (true)
+                {
+                    std::vector<Idle> expired;
+                    std::optional<TCP> candidate;
+                    {
+                        std::unique_lock lock(shard.mutex);
+                        Slot &slot = shard.slots[key];
+                        expire(slot, Clock::now(), expired);
+                        while (slot.idle.empty() && slot.open >= max_per_endpoint)
+                        {
+                            if (deadline == Clock::time_point::max())
+                            {
+                                slot.freed.wait(lock);
+                            }
+                            else if (slot.freed.wait_until(lock, deadline) == std::cv_status::timeout &&
+                                     slot.idle.empty() && slot.open >= max_per_endpoint)
+                            {
+                                assert_throw(false, "Timed out waiting for a pooled connection");
+                            }
+                        }
+                        if (!slot.idle.empty())
+                        {
+                            candidate.emplace(std::move(slot.idle.back().tcp));
+                            slot.idle.pop_back();
+                        }
+                        else
+                        {
+                            ++slot.open;
+                        }
+                    }
+
+                    if (!candidate)
+                    {
+                        try
+                        {
+                            return Lease(this, key, TCP(key, TCP::CLIENT));
+                        }
+                        catch (...)
+                        {
+                            release(key);
+                            throw;
+                        }
+                    }
+                    if (healthy(*candidate))
+                    {
+                        return Lease(this, key, std::move(*candidate));
+                    }
+                    candidate.reset();
+                    release(key);
+                }
+            }
+
+            /*  Closes every idle connection that has waited longer than max_idle, checkout and returns already do
+                this per endpoint so calling it is only needed to clean up endpoints that went quiet */
+            auto evict_idle() -> std::size_t
+            {
+                std::size_t evicted = 0;
+                Clock::time_point now = Clock::now();
+                for (std::unique_ptr<Shard> &shard : shards)
+                {
+                    std::vector<Idle> expired;
+                    std::lock_guard lock(shard->mutex);
+                    for (auto &[key, slot] : shard->slots)
+                    {
+                        evicted += expire(slot, now, expired);
+                    }
+                }
+                return evicted;
+            }
+
+            /* Number of connections open to ip_addr:port, both idle and checked out */
+            auto open(const std::string &ip_addr, const std::string &port) -> std::size_t
+            {
+                return open(Endpoint(ip_addr, port));
+            }
+
+            /* Number of connections open to key, both idle and checked out */
+            auto open(const Endpoint &key) -> std::size_t
+            {
+                Shard &shard = shard_for(key);
+                std::lock_guard lock(shard.mutex);
+                auto it = shard.slots.find(key);
+                return it == shard.slots.end() ? 0 : it->second.open;
+            }
+
+            /* Number of idle connections to ip_addr:port */
+            auto idle(const std::string &ip_addr, const std::string &port) -> std::size_t
+            {
+                return idle(Endpoint(ip_addr, port));
+            }
+
+            /* Number of idle connections to key */
+            auto idle(const Endpoint &key) -> std::size_t
+            {
+                Shard &shard = shard_for(key);
+                std::lock_guard lock(shard.mutex);
+                auto it = shard.slots.find(key);
+                return it == shard.slots.end() ? 0 : it->second.idle.size();
+            }
+    };
+} // namespace jj
+
+#endif
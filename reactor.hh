@@ -0,0 +1,326 @@
+#ifndef REACTOR_HH
+#define REACTOR_HH
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <list>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tcp.hh"
+
+namespace jj
+{
+    /*  A single threaded epoll event loop that owns TCP listeners and connections and calls a handler
+        whenever one of them becomes ready. Sockets are switched to non-blocking mode when added. Handlers
+        should move data with try_read, try_write and poll_frame, which return as soon as the socket would
+        block. operator<< / operator>>, send_all and recv_exact wait until the whole object has moved, so one
+        slow peer would stall every socket on the reactor. Only stop may be called from other threads. */
+    class Reactor
+    {
+        public:
+            enum Event : std::uint32_t
+            {
+                READABLE = EPOLLIN,
+                WRITABLE = EPOLLOUT,
+                HANGUP = EPOLLHUP | EPOLLRDHUP,
+                ERROR = EPOLLERR
+            };
+
+            /* Called with the reactor, the ready socket and the mask of Events that fired */
+            using Handler = std::function<void(Reactor &, TCP &, std::uint32_t)>;
+
+            /* Called on the reactor's thread by every */
+            using Task = std::function<void(Reactor &)>;
+
+            /* TCP_INFO of one connection, as returned by sample_info */
+            struct InfoSample
+            {
+                int fd;
+                Endpoint peer;
+                TCP::Info info;
+            };
+
+        private:
+            struct Entry
+            {
+                TCP tcp;
+                std::uint32_t events;
+                Handler handler;
+                bool removed;
+            };
+
+            int epoll_fd;
+            int wake_fd;
+            std::atomic<bool> stopping = false;
+            bool dispatching = false;
+            std::unordered_map<int, Entry> entries;
+            std::vector<struct epoll_event> ready;
+            std::vector<int> graveyard;
+
+            struct Timer
+            {
+                std::chrono::steady_clock::duration interval;
+                std::chrono::steady_clock::time_point due;
+                Task task;
+            };
+
+            /* A list so timers added from inside a task do not move the one running */
+            std::list<Timer> timers;
+
+            /* Entries are only erased between batches so handlers never see a dangling entry */
+            auto bury() -> void
+            {
+                for (int fd : graveyard)
+                {
+                    entries.erase(fd);
+                }
+                graveyard.clear();
+            }
+
+            /* Shortens timeout_ms so epoll_wait returns in time for the next timer */
+            auto timeout_for(const int timeout_ms) const -> int
+            {
+                if (timers.empty())
+                {
+                    return timeout_ms;
+                }
+                std::chrono::steady_clock::time_point due = timers.front().due;
+                for (const Timer &timer : timers)
+                {
+                    due = std::min(due, timer.due);
+                }
+                auto left = std::chrono::ceil<std::chrono::milliseconds>(due - std::chrono::steady_clock::now());
+                int wait = std::clamp<std::int64_t>(left.count(), 0, std::numeric_limits<int>::max());
+                return timeout_ms == -1 ? wait : std::min(timeout_ms, wait);
+            }
+
+            /*  Runs every timer that is due. A timer that fell behind skips the runs it missed and next runs a full
+                interval from now */
+            auto run_timers() -> void
+            {
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                for (Timer &timer : timers)
+                {
+                    if (timer.due <= now)
+                    {
+                        timer.due += timer.interval;
+                        if (timer.due <= now)
+                        {
+                            timer.due = now + timer.interval;
+                        }
+                        timer.task(*this);
+                    }
+                }
+            }
+
+        public:
+            /* Create a new reactor, max_events is the number of ready sockets handled per epoll_wait */
+            explicit Reactor(const std::size_t max_events = 1024) : ready(max_events)
+            {
+                epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+                assert_throw(epoll_fd != -1, "Failed to create epoll instance");
+
+                /* Wakes epoll_wait when stop is called from another thread, a null data.ptr marks it */
+                wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (wake_fd == -1)
+                {
+                    close(epoll_fd);
+                }
+                assert_throw(wake_fd != -1, "Failed to create wakeup eventfd");
+
+                struct epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.ptr = nullptr;
+                int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+                if (ret == -1)
+                {
+                    close(wake_fd);
+                    close(epoll_fd);
+                }
+                assert_throw(ret != -1, "Failed to watch wakeup eventfd");
+            }
+
+            /* Closes the epoll instance and every socket still owned by the reactor */
+            ~Reactor()
+            {
+                close(wake_fd);
+                close(epoll_fd);
+            }
+
+            /* Reactor should not be copied, since this is undefined behavior */
+            Reactor(const Reactor &obj) = delete;
+
+            /* Reactor should not be copied, since this is undefined behavior */
+            auto operator=(const Reactor &obj) -> Reactor & = delete;
+
+            /*  Takes ownership of tcp and calls handler whenever one of events is ready. Returns a reference to
+                the owned socket */
+            auto add(TCP &&tcp, const std::uint32_t events, Handler handler) -> TCP &
+            {
+                int fd = tcp.fd();
+                tcp.set_nonblocking(true);
+
+                auto [it, inserted] =
+                    entries.try_emplace(fd, Entry{std::move(tcp), events, std::move(handler), false});
+                assert_throw(inserted, "Socket is already registered");
+
+                struct epoll_event ev = {};
+                ev.events = events;
+                ev.data.ptr = &it->second;
+                int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+                if (ret == -1)
+                {
+                    entries.erase(it);
+                }
+                assert_throw(ret != -1, "Failed to register socket");
+
+                return it->second.tcp;
+            }
+
+            /* Changes the set of events tcp is waiting on, e.g. to start or stop waiting for WRITABLE */
+            auto modify(TCP &tcp, const std::uint32_t events) -> void
+            {
+                auto it = entries.find(tcp.fd());
+                assert_throw(it != entries.end() && !it->second.removed, "Socket is not registered");
+
+                struct epoll_event ev = {};
+                ev.events = events;
+                ev.data.ptr = &it->second;
+                int ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, tcp.fd(), &ev);
+                assert_throw(ret != -1, "Failed to modify socket");
+                it->second.events = events;
+            }
+
+            /*  Stops watching tcp and closes it once the current batch of events has been handled, so it is safe
+                to call from inside the socket's own handler */
+            auto remove(TCP &tcp) -> void
+            {
+                auto it = entries.find(tcp.fd());
+                assert_throw(it != entries.end(), "Socket is not registered");
+                if (it->second.removed)
+                {
+                    return;
+                }
+
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, tcp.fd(), nullptr);
+                it->second.removed = true;
+                graveyard.push_back(tcp.fd());
+                if (!dispatching)
+                {
+                    bury();
+                }
+            }
+
+            /* Number of sockets owned by the reactor */
+            auto size() const -> std::size_t
+            {
+                return entries.size() - graveyard.size();
+            }
+
+            /*  Waits up to timeout_ms (-1 waits forever) for sockets to become ready and dispatches their
+                handlers. Returns the number of handlers called */
+            auto poll(const int timeout_ms = -1) -> std::size_t
+            {
+                int nready = epoll_wait(epoll_fd, ready.data(), ready.size(), timeout_for(timeout_ms));
+                if (nready == -1 && errno == EINTR)
+                {
+                    return 0;
+                }
+                assert_throw(nready != -1, "Failed to wait for events");
+
+                dispatching = true;
+                std::size_t dispatched = 0;
+                try
+                {
+                    for (int i = 0; i < nready; ++i)
+                    {
+                        if (ready[i].data.ptr == nullptr)
+                        {
+                            std::uint64_t count;
+                            [[maybe_unused]] ssize_t ret = ::read(wake_fd, &count, sizeof(count));
+                            continue;
+                        }
+                        Entry &entry = *static_cast<Entry *>(ready[i].data.ptr);
+                        if (entry.removed)
+                        {
+                            continue;
+                        }
+                        entry.handler(*this, entry.tcp, ready[i].events);
+                        ++dispatched;
+                    }
+                }
+                catch (...)
+                {
+                    dispatching = false;
+                    bury();
+                    throw;
+                }
+                dispatching = false;
+
+                bury();
+                run_timers();
+                return dispatched;
+            }
+
+            /*  Calls task on the reactor's thread every interval, starting one interval from now. Tasks run
+                between batches of events, so they can use and remove sockets like handlers can */
+            auto every(const std::chrono::steady_clock::duration interval, Task task) -> void
+            {
+                assert_throw(interval > std::chrono::steady_clock::duration::zero(), "Interval must be positive");
+                timers.push_back(Timer{interval, std::chrono::steady_clock::now() + interval, std::move(task)});
+            }
+
+            /*  TCP_INFO of every TCP connection owned by the reactor, listeners and Unix sockets are skipped.
+                Call it from the reactor's thread, e.g. from a task given to every */
+            auto sample_info() -> std::vector<InfoSample>
+            {
+                std::vector<InfoSample> samples;
+                samples.reserve(entries.size());
+                for (auto &[fd, entry] : entries)
+                {
+                    TCP &tcp = entry.tcp;
+                    if (entry.removed || tcp.get_side() == TCP::SERVER)
+                    {
+                        continue;
+                    }
+                    Endpoint peer = tcp.peer();
+                    if (peer.family() == AF_UNIX)
+                    {
+                        continue;
+                    }
+                    samples.push_back(InfoSample{fd, peer, tcp.info()});
+                }
+                return samples;
+            }
+
+            /* Dispatches events until stop is called, a stop that arrived before run makes it return at once */
+            auto run() -> void
+            {
+                while (!stopping.exchange(false))
+                {
+                    poll(-1);
+                }
+            }
+
+            /*  Makes run return after the current batch of events, safe to call from any thread since a blocked
+                epoll_wait is woken up */
+            auto stop() -> void
+            {
+                stopping = true;
+                std::uint64_t one = 1;
+                [[maybe_unused]] ssize_t ret = ::write(wake_fd, &one, sizeof(one));
+            }
+    };
+} // namespace jj
+
+#endif
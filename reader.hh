@@ -0,0 +1,161 @@
+#ifndef READER_HH
+#define READER_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <poll.h>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "ring.hh"
+#include "tcp.hh"
+
+namespace jj
+{
+    /*  Reads a TCP stream through a large internal buffer so that parsing many small records costs one recv per
+        buffer fill instead of one per record. The buffer is a MirrorRing, so consuming never moves bytes around
+        and a record that wraps past the end of the buffer is still one contiguous view. Views returned by peek,
+        read_exact and read_until point into the buffer and are only valid until the next call on the reader. */
+    class BufferedReader
+    {
+        private:
+            TCP &tcp;
+            MirrorRing ring;
+
+            /* How many of the unread bytes read_until has already searched */
+            std::size_t scanned = 0;
+
+            /*  Makes room for need more bytes, only a record longer than the whole ring makes it grow, which
+                copies the unread bytes into a ring at least twice the size */
+            auto reserve(std::size_t need) -> void
+            {
+                if (ring.space() >= need)
+                {
+                    return;
+                }
+                MirrorRing bigger(std::max(ring.capacity() * 2, ring.size() + need));
+                std::string_view unread = ring.readable();
+                std::memcpy(bigger.writable().data(), unread.data(), unread.size());
+                bigger.commit(unread.size());
+                ring = std::move(bigger);
+            }
+
+            /* Fills until at least n bytes are buffered, waiting on non-blocking sockets */
+            auto fill_to(std::size_t n) -> void
+            {
+                if (ring.size() >= n)
+                {
+                    return;
+                }
+                reserve(n - ring.size());
+                while (ring.size() < n)
+                {
+                    ssize_t nbytes = fill();
+                    assert_throw(nbytes != 0, "Connection closed by peer");
+                    if (nbytes == -1)
+                    {
+                        struct pollfd pfd = {tcp.fd(), POLLIN, 0};
+                        poll(&pfd, 1, -1);
+                    }
+                }
+            }
+
+        public:
+            /* Create a new reader on tcp, capacity is the size of a single fill rounded up to a power of two pages */
+            explicit BufferedReader(TCP &tcp, const std::size_t capacity = 64 << 10) : tcp(tcp), ring(capacity)
+            {
+            }
+
+            /*  Reads once from the socket into the free end of the buffer. Returns the number of bytes added, 0 if
+                the peer closed the connection and -1 if the socket is non-blocking and nothing was ready */
+            auto fill() -> ssize_t
+            {
+                if (ring.space() == 0)
+                {
+                    reserve(ring.capacity());
+                }
+                return tcp.read(ring);
+            }
+
+            /* Number of bytes buffered and not yet consumed */
+            auto available() const -> std::size_t
+            {
+                return ring.size();
+            }
+
+            /* Everything buffered and not yet consumed, without reading from the socket */
+            auto buffered() const -> std::string_view
+            {
+                return ring.readable();
+            }
+
+            /* Waits until n bytes are buffered and returns them without consuming them */
+            auto peek(const std::size_t n) -> std::string_view
+            {
+                fill_to(n);
+                return ring.readable().substr(0, n);
+            }
+
+            /* Drops the next n buffered bytes */
+            auto consume(const std::size_t n) -> void
+            {
+                ring.consume(n);
+                scanned = scanned > n ? scanned - n : 0;
+            }
+
+            /* Waits for the next n bytes and consumes them */
+            auto read_exact(const std::size_t n) -> std::string_view
+            {
+                std::string_view view = peek(n);
+                consume(n);
+                return view;
+            }
+
+            /*  Reads the next trivially copyable object from the stream, it is copied out since the buffer gives no
+                alignment guarantees */
+            template <typename T> auto read_exact() -> T
+            {
+                static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be received");
+                T obj;
+                std::memcpy(&obj, peek(sizeof(T)).data(), sizeof(T));
+                consume(sizeof(T));
+                return obj;
+            }
+
+            /*  Waits for the next delimiter and returns everything before it, the delimiter is consumed but not
+                part of the view. Throws if no delimiter shows up within max_length bytes */
+            auto read_until(const std::string_view delim, const std::size_t max_length = 64 << 10)
+                -> std::string_view
+            {
+                assert_throw(!delim.empty(), "Delimiter can not be empty");
+                while (true)
+                {
+                    /* Only look at bytes that have not been searched yet, keeping a delimiter split across
+                        fills in view */
+                    std::size_t from = scanned >= delim.size() ? scanned - delim.size() + 1 : 0;
+                    std::string_view unread = ring.readable();
+                    std::size_t pos = unread.find(delim, from);
+                    if (pos != std::string_view::npos)
+                    {
+                        std::string_view record = unread.substr(0, pos);
+                        consume(record.size() + delim.size());
+                        return record;
+                    }
+                    scanned = unread.size();
+                    assert_throw(unread.size() < max_length, "Delimiter not found within max_length bytes");
+                    fill_to(unread.size() + 1);
+                }
+            }
+
+            /* Single character version of read_until, e.g. read_until('\n') for line protocols */
+            auto read_until(const char delim, const std::size_t max_length = 64 << 10) -> std::string_view
+            {
+                return read_until(std::string_view(&delim, 1), max_length);
+            }
+    };
+} // namespace jj
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef RING_HH
+#define RING_HH
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+#include "common.hh"
+
+namespace jj
+{
+    /*  A byte ring buffer whose memory is mapped twice back to back, so the bytes at the end of the buffer
+        continue straight into the bytes at the start. Both the unread bytes and the free space are therefore
+        always one contiguous span, reads can land in it directly and parsers never have to compact or stitch
+        together a record that wraps around. */
+    class MirrorRing
+    {
+        private:
+            char *base = nullptr;
+            std::size_t cap = 0;
+            std::uint64_t head = 0;
+            std::uint64_t tail = 0;
+
+        public:
+            /*  Maps the first capacity bytes of fd twice, back to back, capacity must be a multiple of the page
+                size. The mapping stays valid after fd is closed and is released with munmap(base, 2 * capacity) */
+            static auto map(const int fd, const std::size_t capacity) -> char *
+            {
+                void *reserved = mmap(nullptr, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                assert_throw(reserved != MAP_FAILED, "Failed to reserve ring memory");
+                char *start = static_cast<char *>(reserved);
+
+                void *first = mmap(start, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+                void *second = first == MAP_FAILED ? MAP_FAILED
+                                                   : mmap(start + capacity, capacity, PROT_READ | PROT_WRITE,
+                                                          MAP_SHARED | MAP_FIXED, fd, 0);
+                if (second == MAP_FAILED)
+                {
+                    munmap(start, 2 * capacity);
+                }
+                assert_throw(second != MAP_FAILED, "Failed to map ring memory");
+                return start;
+            }
+
+            /* Rounds size up to a power of two that is at least one page, which is what the ring will hold */
+            static auto round_capacity(const std::size_t size) -> std::size_t
+            {
+                return std::bit_ceil(std::max(size, static_cast<std::size_t>(sysconf(_SC_PAGESIZE))));
+            }
+
+            /* Create a new ring holding at least min_capacity bytes, rounded up to a power of two pages */
+            explicit MirrorRing(const std::size_t min_capacity = 1 << 20) : cap(round_capacity(min_capacity))
+            {
+                int fd = memfd_create("jj-ring", MFD_CLOEXEC);
+                assert_throw(fd != -1, "Failed to create ring memfd");
+                if (ftruncate(fd, cap) == -1)
+                {
+                    close(fd);
+                    assert_throw(false, "Failed to size ring memfd");
+                }
+                try
+                {
+                    base = map(fd, cap);
+                }
+                catch (...)
+                {
+                    close(fd);
+                    throw;
+                }
+                close(fd);
+            }
+
+            /* Unmaps the ring */
+            ~MirrorRing()
+            {
+                if (base != nullptr)
+                {
+                    munmap(base, 2 * cap);
+                }
+            }
+
+            /* MirrorRing should not be copied, since this is undefined behavior */
+            MirrorRing(const MirrorRing &obj) = delete;
+
+            /* MirrorRing should not be copied, since this is undefined behavior */
+            auto operator=(const MirrorRing &obj) -> MirrorRing & = delete;
+
+            /* MirrorRing move constructor */
+            MirrorRing(MirrorRing &&obj)
+                : base(std::exchange(obj.base, nullptr)), cap(std::exchange(obj.cap, 0)),
+                  head(std::exchange(obj.head, 0)), tail(std::exchange(obj.tail, 0))
+            {
+            }
+
+            /* MirrorRing move assignment */
+            auto operator=(MirrorRing &&obj) -> MirrorRing &
+            {
+                if (this != &obj)
+                {
+                    if (base != nullptr)
+                    {
+                        munmap(base, 2 * cap);
+                    }
+                    base = std::exchange(obj.base, nullptr);
+                    cap = std::exchange(obj.cap, 0);
+                    head = std::exchange(obj.head, 0);
+                    tail = std::exchange(obj.tail, 0);
+                }
+                return *this;
+            }
+
+            /* Every unread byte as one contiguous view, valid until the bytes are consumed */
+            auto readable() const -> std::string_view
+            {
+                return std::string_view(base + (head & (cap - 1)), tail - head);
+            }
+
+            /* All free space as one contiguous span, write into it and then call commit */
+            auto writable() -> std::span<char>
+            {
+                return std::span<char>(base + (tail & (cap - 1)), cap - (tail - head));
+            }
+
+            /* Marks the first n bytes of writable() as filled */
+            auto commit(const std::size_t n) -> void
+            {
+                assert_throw(n <= cap - (tail - head), "Can not commit more than the free space");
+                tail += n;
+            }
+
+            /* Drops the first n unread bytes */
+            auto consume(const std::size_t n) -> void
+            {
+                assert_throw(n <= tail - head, "Can not consume more than is buffered");
+                head += n;
+            }
+
+            /* Number of unread bytes */
+            auto size() const -> std::size_t
+            {
+                return tail - head;
+            }
+
+            /* Number of bytes that can be written before the ring is full */
+            auto space() const -> std::size_t
+            {
+                return cap - (tail - head);
+            }
+
+            /* Total number of bytes the ring holds */
+            auto capacity() const -> std::size_t
+            {
+                return cap;
+            }
+
+            /* Whether there is nothing to read */
+            auto empty() const -> bool
+            {
+                return tail == head;
+            }
+    };
+} // namespace jj
+
+#endif
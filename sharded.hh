@@ -0,0 +1,258 @@
+#ifndef SHARDED_HH
+#define SHARDED_HH
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <linux/filter.h>
+#include <memory>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "reactor.hh"
+#include "tcp.hh"
+
+namespace jj
+{
+    /*  A TCP server spread over several threads. Every shard binds its own SO_REUSEPORT listener on the same
+        port and runs its own Reactor, so the kernel balances new connections between shards and accepting,
+        reading and writing never share a lock or a core. With CPU steering shard i is pinned to the i-th cpu
+        the process may run on and gets the connections whose packets were handled on that cpu, so a connection
+        stays on one core from the softirq to the handler. Connections arriving on a cpu without a shard are
+        spread by hash. */
+    class ShardedServer
+    {
+        public:
+            /* Called on the accepting shard's thread for every new connection, usually to add it to the reactor */
+            using Setup = std::function<void(Reactor &, TCP &&, std::size_t)>;
+
+            /* How the kernel picks the shard for a new connection */
+            enum Steering
+            {
+                /* Hash of the connection's addresses and ports */
+                HASH,
+
+                /* The cpu that handled the connection's packets, shards are pinned to their cpu */
+                CPU
+            };
+
+        private:
+            struct Shard
+            {
+                Reactor reactor;
+                TCP *listener;
+                int cpu = -1;
+                std::vector<TCP> accepted;
+                std::exception_ptr error;
+            };
+
+            std::vector<std::unique_ptr<Shard>> shards;
+            std::vector<std::thread> threads;
+            Setup setup;
+            Steering steering;
+
+            /* The cpus this process is allowed to run on, in ascending order */
+            static auto allowed_cpus() -> std::vector<int>
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                assert_throw(sched_getaffinity(0, sizeof(set), &set) == 0, "Failed to get cpu affinity");
+                std::vector<int> cpus;
+                for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                {
+                    if (CPU_ISSET(cpu, &set))
+                    {
+                        cpus.push_back(cpu);
+                    }
+                }
+                return cpus;
+            }
+
+            /* Waits for every shard thread and returns the first error one of them stopped with */
+            auto join() -> std::exception_ptr
+            {
+                std::exception_ptr error;
+                for (std::size_t i = 0; i < threads.size(); ++i)
+                {
+                    shards[i]->reactor.stop();
+                }
+                for (std::size_t i = 0; i < threads.size(); ++i)
+                {
+                    threads[i].join();
+                    if (!error)
+                    {
+                        error = shards[i]->error;
+                    }
+                }
+                threads.clear();
+                return error;
+            }
+
+        public:
+            /*  Create a server with shard_count listeners on port, connections are handed to setup. The
+                listeners are bound straight away so a busy port throws here instead of inside a thread. CPU
+                steering needs an allowed cpu for every shard, see sched_getaffinity */
+            ShardedServer(const std::string port, Setup setup,
+                          const std::size_t shard_count = std::thread::hardware_concurrency(),
+                          const int backlog = SOMAXCONN, const Steering steering = HASH)
+                : setup(std::move(setup)), steering(steering)
+            {
+                assert_throw(shard_count > 0, "A sharded server needs at least one shard");
+                std::vector<int> cpus = steering == CPU ? allowed_cpus() : std::vector<int>();
+                assert_throw(steering == HASH || shard_count <= cpus.size(),
+                             "CPU steering needs a cpu for every shard");
+                for (std::size_t i = 0; i < shard_count; ++i)
+                {
+                    auto shard = std::make_unique<Shard>();
+                    TCP listener("", port, TCP::SERVER, TCP::Options{.backlog = backlog, .reuse_port = true});
+                    if (steering == CPU)
+                    {
+                        shard->cpu = cpus[i];
+                        listener.set_incoming_cpu(shard->cpu);
+                    }
+                    shard->listener = &shard->reactor.add(std::move(listener), Reactor::READABLE,
+                        [this, i](Reactor &reactor, TCP &listener, std::uint32_t)
+                        {
+                            std::vector<TCP> &accepted = shards[i]->accepted;
+                            accepted.clear();
+                            listener.accept_all(accepted);
+                            for (TCP &tcp : accepted)
+                            {
+                                this->setup(reactor, std::move(tcp), i);
+                            }
+                        });
+                    shards.push_back(std::move(shard));
+                }
+
+                /*  Listeners are indexed in bind order, so returning i for the cpu of shard i sends each connection
+                    to the shard pinned to the cpu that received it. Any other cpu returns an index past the last
+                    listener, which makes the kernel fall back to its hash */
+                if (steering == CPU)
+                {
+                    std::vector<struct sock_filter> program = {
+                        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<std::uint32_t>(SKF_AD_OFF + SKF_AD_CPU))};
+                    for (std::size_t i = 0; i < shard_count; ++i)
+                    {
+                        auto cpu = static_cast<std::uint32_t>(cpus[i]);
+                        program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, 1));
+                        program.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<std::uint32_t>(i)));
+                    }
+                    program.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<std::uint32_t>(shard_count)));
+                    shards[0]->listener->attach_reuseport_filter(program);
+                }
+            }
+
+            /* Stops and joins every shard, errors from the shards are dropped */
+            ~ShardedServer()
+            {
+                join();
+            }
+
+            /* ShardedServer should not be copied, since this is undefined behavior */
+            ShardedServer(const ShardedServer &obj) = delete;
+
+            /* ShardedServer should not be copied, since this is undefined behavior */
+            auto operator=(const ShardedServer &obj) -> ShardedServer & = delete;
+
+            /*  Starts one thread per shard, each running its reactor until stop is called. With CPU steering every
+                thread pins itself before its reactor runs, so no event is handled on the wrong cpu, and start waits
+                for that. If a shard can not be pinned the threads already started are stopped again before this
+                throws */
+            auto start() -> void
+            {
+                assert_throw(threads.empty(), "Server is already running");
+                try
+                {
+                    for (std::size_t i = 0; i < shards.size(); ++i)
+                    {
+                        std::promise<void> pinned;
+                        std::future<void> ready = pinned.get_future();
+                        threads.emplace_back(
+                            [shard = shards[i].get(), pin = steering == CPU, pinned = std::move(pinned)]() mutable
+                            {
+                                if (pin)
+                                {
+                                    cpu_set_t cpus;
+                                    CPU_ZERO(&cpus);
+                                    CPU_SET(shard->cpu, &cpus);
+                                    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+                                    {
+                                        pinned.set_exception(std::make_exception_ptr(
+                                            std::runtime_error("Failed to pin shard to its cpu")));
+                                        return;
+                                    }
+                                }
+                                pinned.set_value();
+                                try
+                                {
+                                    shard->reactor.run();
+                                }
+                                catch (...)
+                                {
+                                    shard->error = std::current_exception();
+                                }
+                            });
+                        ready.get();
+                    }
+                }
+                catch (...)
+                {
+                    join();
+                    throw;
+                }
+            }
+
+            /* Receives the shard index and the TCP_INFO of every connection on that shard */
+            using InfoSink = std::function<void(std::size_t, const std::vector<Reactor::InfoSample> &)>;
+
+            /*  Samples every connection on every shard each interval and passes the samples to sink. sink runs
+                on the shard threads, possibly at the same time, so it has to be thread safe. Call before start */
+            auto sample_info(const std::chrono::steady_clock::duration interval, InfoSink sink) -> void
+            {
+                assert_throw(threads.empty(), "Samplers must be added before the server starts");
+                for (std::size_t i = 0; i < shards.size(); ++i)
+                {
+                    shards[i]->reactor.every(interval,
+                                             [i, sink](Reactor &reactor) { sink(i, reactor.sample_info()); });
+                }
+            }
+
+            /* Stops every shard and waits for their threads, rethrowing the first error a shard stopped with */
+            auto stop() -> void
+            {
+                if (std::exception_ptr error = join())
+                {
+                    std::rethrow_exception(error);
+                }
+            }
+
+            /* How new connections are spread over the shards */
+            auto get_steering() const -> Steering
+            {
+                return steering;
+            }
+
+            /* Number of shards, and so listeners and threads */
+            auto size() const -> std::size_t
+            {
+                return shards.size();
+            }
+
+            /*  The reactor of shard i, only safe to touch from that shard's own handlers or while the server is
+                stopped */
+            auto reactor(const std::size_t i) -> Reactor &
+            {
+                return shards.at(i)->reactor;
+            }
+    };
+} // namespace jj
+
+#endif
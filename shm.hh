@@ -0,0 +1,619 @@
+#ifndef SHM_HH
+#define SHM_HH
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <optional>
+#include <poll.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "common.hh"
+#include "endpoint.hh"
+#include "ring.hh"
+#include "tcp.hh"
+
+namespace jj
+{
+    /*  A message channel between two processes on the same host that moves data through shared memory instead
+        of the kernel. The connection is set up over a Unix socket, the client creates one ring per direction
+        in a memfd and passes them to the server with SCM_RIGHTS, after that every message is a copy into the
+        ring and a copy out on the other side. A side with nothing to do spins for a short while and then
+        sleeps on a futex in the ring, so idle channels cost no CPU.
+
+        Every operator<< sends one message and every operator>> receives one, like TCP in LENGTH_PREFIXED
+        mode. Each direction has a single producer and a single consumer, share an SHM between threads only
+        with outside locking */
+    class SHM
+    {
+        public:
+            enum Side
+            {
+                CLIENT,
+                SERVER,
+                CONNECTION
+            };
+
+            struct Options
+            {
+                /* Bytes per direction, rounded up to a power of two pages, a message can use all but 8 */
+                std::size_t capacity = 1 << 20;
+
+                /*  Times to check the ring before sleeping on the futex, 0 sleeps straight away. Spinning only helps
+                    when the other side runs on another CPU, so single CPU machines skip it */
+                unsigned spin = std::thread::hardware_concurrency() > 1 ? 1024 : 0;
+
+                /*  How long accept_connection waits for a connected client to send its rings before throwing
+                    TimeoutError, zero waits forever */
+                std::chrono::steady_clock::duration handshake_timeout = std::chrono::seconds(5);
+            };
+
+        private:
+            /* Shared state of one ring, kept in the page after the ring data so both processes map it */
+            struct Control
+            {
+                /* Written by the producer only */
+                alignas(64) std::atomic<std::uint64_t> tail;
+
+                /* Written by the consumer only */
+                alignas(64) std::atomic<std::uint64_t> head;
+
+                /* Futex words, set by a side before it sleeps and cleared by whoever wakes it */
+                alignas(64) std::atomic<std::uint32_t> reader_waiting;
+                std::atomic<std::uint32_t> writer_waiting;
+
+                /* Set when either side goes away */
+                std::atomic<std::uint32_t> closed;
+            };
+
+            /* One direction of the channel, data is mapped twice back to back so records never wrap */
+            struct Ring
+            {
+                char *data = nullptr;
+                Control *control = nullptr;
+                std::size_t cap = 0;
+
+                /* This side's copy of the index it advances, and the last seen value of the other side's */
+                std::uint64_t own = 0;
+                std::uint64_t seen = 0;
+            };
+
+            static constexpr std::size_t HEADER = 8;
+            static constexpr std::uint32_t MAGIC = 0x6a6a736d;
+
+            /* Sent with the ring descriptors during the handshake */
+            struct Hello
+            {
+                std::uint32_t magic;
+                std::uint32_t version;
+                std::uint64_t capacity;
+            };
+
+            Side side;
+            TCP sock;
+            Ring tx;
+            Ring rx;
+            Options options;
+
+            /* Bytes of the last record returned by read_frame, released on the next read */
+            std::size_t rx_pending = 0;
+
+            /*  Set once the peer left something impossible in the rings, after that the channel is closed and
+                every read and write throws */
+            bool broken = false;
+
+            static auto page_size() -> std::size_t
+            {
+                return sysconf(_SC_PAGESIZE);
+            }
+
+            /* Space a message of size bytes takes in the ring, records stay 8 byte aligned */
+            static auto record_size(const std::size_t size) -> std::size_t
+            {
+                return HEADER + ((size + 7) & ~std::size_t{7});
+            }
+
+            static auto futex_wait(std::atomic<std::uint32_t> &word, const std::uint32_t expected,
+                                   const struct timespec *timeout) -> long
+            {
+                return syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAIT, expected, timeout,
+                               nullptr, 0);
+            }
+
+            static auto futex_wake(std::atomic<std::uint32_t> &word) -> void
+            {
+                syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+                        0);
+            }
+
+            static auto cpu_relax() -> void
+            {
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#elif defined(__aarch64__)
+                asm volatile("yield");
+#endif
+            }
+
+            /* Wakes the other side if it went to sleep on word, after the index it waits for was published */
+            static auto notify(std::atomic<std::uint32_t> &word) -> void
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (word.load(std::memory_order_relaxed) != 0 && word.exchange(0) != 0)
+                {
+                    futex_wake(word);
+                }
+            }
+
+            /* Creates a sealed memfd holding a ring of capacity bytes followed by its control page */
+            static auto create_ring(const std::size_t capacity) -> int
+            {
+                int fd = memfd_create("jj-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+                assert_throw(fd != -1, "Failed to create shared memory");
+                if (ftruncate(fd, capacity + page_size()) == -1 ||
+                    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+                {
+                    close(fd);
+                    assert_throw(false, "Failed to size shared memory");
+                }
+                return fd;
+            }
+
+            /*  Maps a ring created by create_ring. The file must be sealed against shrinking, otherwise the
+                other process could cut it short and crash this one on the next access */
+            static auto map_ring(const int fd, const std::size_t capacity) -> Ring
+            {
+                struct stat st;
+                assert_throw(fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) == capacity + page_size(),
+                             "Shared memory has the wrong size");
+                int seals = fcntl(fd, F_GET_SEALS);
+                assert_throw(seals != -1 && (seals & F_SEAL_SHRINK) != 0, "Shared memory is not sealed");
+
+                Ring ring;
+                ring.cap = capacity;
+                ring.data = MirrorRing::map(fd, capacity);
+                void *control = mmap(nullptr, page_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, capacity);
+                if (control == MAP_FAILED)
+                {
+                    munmap(ring.data, 2 * capacity);
+                    assert_throw(false, "Failed to map shared memory");
+                }
+                ring.control = static_cast<Control *>(control);
+                return ring;
+            }
+
+            static auto unmap_ring(Ring &ring) -> void
+            {
+                if (ring.data != nullptr)
+                {
+                    munmap(ring.data, 2 * ring.cap);
+                    munmap(ring.control, page_size());
+                }
+                ring.data = nullptr;
+                ring.control = nullptr;
+            }
+
+            /* Used internally to create the accepted end of a channel from the handshake connection */
+            SHM(TCP &&sock, const Options &options)
+                : side(Side::CONNECTION), sock(std::move(sock)), options(options)
+            {
+                Hello hello = {};
+                int fds[2] = {-1, -1};
+                char control[CMSG_SPACE(sizeof(fds))] = {};
+                struct iovec iov = {&hello, sizeof(hello)};
+                struct msghdr msg = {};
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                /* A client that connects and never sends its rings must not hold up the server forever */
+                auto deadline = options.handshake_timeout == std::chrono::steady_clock::duration::zero()
+                                    ? NO_DEADLINE
+                                    : std::chrono::steady_clock::now() + options.handshake_timeout;
+                ssize_t nbytes;
+                while (true)
+                {
+                    nbytes = recvmsg(this->sock.fd(), &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+                    if (nbytes != -1 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+                    {
+                        break;
+                    }
+                    if (errno != EINTR && !wait_fd(this->sock.fd(), POLLIN, deadline))
+                    {
+                        if (errno == ETIMEDOUT)
+                        {
+                            throw TimeoutError("Timed out waiting for shared memory handshake");
+                        }
+                        assert_throw(false, "Failed to wait for shared memory handshake");
+                    }
+                }
+
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                {
+                    std::memcpy(fds, CMSG_DATA(cmsg), std::min(sizeof(fds), cmsg->cmsg_len - CMSG_LEN(0)));
+                }
+
+                try
+                {
+                    assert_throw(nbytes == sizeof(hello) && hello.magic == MAGIC && hello.version == 1 &&
+                                     fds[0] != -1 && fds[1] != -1,
+                                 "Invalid shared memory handshake");
+                    assert_throw(std::has_single_bit(hello.capacity) && hello.capacity >= page_size(),
+                                 "Invalid shared memory capacity");
+                    rx = map_ring(fds[0], hello.capacity);
+                    tx = map_ring(fds[1], hello.capacity);
+                }
+                catch (...)
+                {
+                    unmap_ring(rx);
+                    unmap_ring(tx);
+                    close(fds[0]);
+                    close(fds[1]);
+                    throw;
+                }
+                close(fds[0]);
+                close(fds[1]);
+            }
+
+            /*  Whether the other process went away without closing the channel, e.g. because it crashed. The
+                handshake socket is never written to again, so it only becomes readable on hang up */
+            auto peer_gone() -> bool
+            {
+                struct pollfd pfd = {sock.fd(), POLLIN | POLLRDHUP, 0};
+                return poll(&pfd, 1, 0) == 1;
+            }
+
+            /*  Waits until ready() holds, spinning first and then sleeping on word. Returns false if the channel
+                was closed first */
+            template <typename Ready> auto wait(Ring &ring, std::atomic<std::uint32_t> &word, Ready ready) -> bool
+            {
+                for (unsigned i = 0; i < options.spin; ++i)
+                {
+                    if (ready())
+                    {
+                        return true;
+                    }
+                    cpu_relax();
+                }
+
+                /* The timeout only bounds how long a crashed peer goes unnoticed */
+                struct timespec timeout = {0, 100'000'000};
+                while (true)
+                {
+                    word.store(1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (ready())
+                    {
+                        word.store(0, std::memory_order_relaxed);
+                        return true;
+                    }
+                    if (ring.control->closed.load(std::memory_order_acquire) != 0)
+                    {
+                        return false;
+                    }
+                    if (futex_wait(word, 1, &timeout) == -1 && errno == ETIMEDOUT && peer_gone())
+                    {
+                        ring.control->closed.store(1, std::memory_order_release);
+                    }
+                }
+            }
+
+            /* Releases the record handed out by the last read_frame */
+            auto release_pending() -> void
+            {
+                if (rx_pending != 0)
+                {
+                    rx.own += rx_pending;
+                    rx_pending = 0;
+                    rx.control->head.store(rx.own, std::memory_order_release);
+                    notify(rx.control->writer_waiting);
+                }
+            }
+
+            /* Returns the next record, waiting for one if block is set */
+            auto next_frame(const bool block) -> std::optional<std::string_view>
+            {
+                assert_throw(side != Side::SERVER, "Can not read from server");
+                assert_throw(!broken, "Shared memory channel is corrupt");
+                release_pending();
+
+                auto ready = [this]
+                {
+                    if (rx.seen == rx.own)
+                    {
+                        rx.seen = rx.control->tail.load(std::memory_order_acquire);
+                    }
+                    return rx.seen != rx.own;
+                };
+                if (!ready())
+                {
+                    if (!block)
+                    {
+                        assert_throw(rx.control->closed.load(std::memory_order_acquire) == 0,
+                                     "Connection closed by peer");
+                        return std::nullopt;
+                    }
+                    assert_throw(wait(rx, rx.control->reader_waiting, ready), "Connection closed by peer");
+                }
+
+                /*  The tail and the header are written by the other process, a record that does not fit in what
+                    it published would point past the mapping */
+                const char *at = rx.data + (rx.own & (rx.cap - 1));
+                std::uint32_t size;
+                std::memcpy(&size, at, sizeof(size));
+                std::uint64_t available = rx.seen - rx.own;
+                if (available > rx.cap || record_size(size) > available)
+                {
+                    broken = true;
+                    close_channel();
+                    assert_throw(false, "Shared memory channel is corrupt");
+                }
+                rx_pending = record_size(size);
+                return std::string_view(at + HEADER, size);
+            }
+
+            /* Reserves room for a message of size bytes and returns where its payload goes */
+            auto claim(const std::size_t size) -> char *
+            {
+                assert_throw(side != Side::SERVER, "Can not write to server");
+                assert_throw(!broken, "Shared memory channel is corrupt");
+                std::size_t need = record_size(size);
+                assert_throw(need <= tx.cap, "Message is larger than the ring");
+
+                auto ready = [this, need]
+                {
+                    if (tx.cap - (tx.own - tx.seen) < need)
+                    {
+                        tx.seen = tx.control->head.load(std::memory_order_acquire);
+                    }
+                    return tx.cap - (tx.own - tx.seen) >= need;
+                };
+                assert_throw(tx.control->closed.load(std::memory_order_relaxed) == 0, "Connection closed by peer");
+                if (!ready())
+                {
+                    assert_throw(wait(tx, tx.control->writer_waiting, ready), "Connection closed by peer");
+                }
+
+                char *at = tx.data + (tx.own & (tx.cap - 1));
+                std::uint32_t header = size;
+                std::memcpy(at, &header, sizeof(header));
+                return at + HEADER;
+            }
+
+            /* Makes the message placed by the last claim visible to the reader */
+            auto publish(const std::size_t size) -> void
+            {
+                tx.own += record_size(size);
+                tx.control->tail.store(tx.own, std::memory_order_release);
+                notify(tx.control->reader_waiting);
+            }
+
+            /* Marks both rings closed, wakes the other side if it sleeps on one and unmaps them */
+            auto close_channel() -> void
+            {
+                for (Ring *ring : {&tx, &rx})
+                {
+                    if (ring->control != nullptr)
+                    {
+                        ring->control->closed.store(1, std::memory_order_release);
+                        ring->control->reader_waiting.store(0, std::memory_order_relaxed);
+                        ring->control->writer_waiting.store(0, std::memory_order_relaxed);
+                        futex_wake(ring->control->reader_waiting);
+                        futex_wake(ring->control->writer_waiting);
+                    }
+                    unmap_ring(*ring);
+                }
+            }
+
+        public:
+            /*  Create a new SHM object. A server listens on endpoint and must be a Unix socket, see
+                Endpoint::local, a client connects to it and sets up the rings */
+            SHM(const Endpoint &endpoint, const Side &side) : SHM(endpoint, side, Options{})
+            {
+            }
+
+            /* Same as above, options.capacity is chosen by the client and applies to both directions */
+            SHM(const Endpoint &endpoint, const Side &side, const Options &options)
+                : side(side), sock(endpoint, side == Side::SERVER ? TCP::SERVER : TCP::CLIENT), options(options)
+            {
+                assert_throw(endpoint.family() == AF_UNIX, "Shared memory needs a Unix endpoint for the handshake");
+                assert_throw(side != Side::CONNECTION, "Connections are created by accept_connection");
+                if (side == Side::SERVER)
+                {
+                    return;
+                }
+
+                std::size_t capacity = MirrorRing::round_capacity(options.capacity);
+                int fds[2] = {create_ring(capacity), -1};
+                try
+                {
+                    fds[1] = create_ring(capacity);
+                    tx = map_ring(fds[0], capacity);
+                    rx = map_ring(fds[1], capacity);
+
+                    Hello hello = {MAGIC, 1, capacity};
+                    char control[CMSG_SPACE(sizeof(fds))] = {};
+                    struct iovec iov = {&hello, sizeof(hello)};
+                    struct msghdr msg = {};
+                    msg.msg_iov = &iov;
+                    msg.msg_iovlen = 1;
+                    msg.msg_control = control;
+                    msg.msg_controllen = sizeof(control);
+                    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                    cmsg->cmsg_level = SOL_SOCKET;
+                    cmsg->cmsg_type = SCM_RIGHTS;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+                    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+                    ssize_t nbytes;
+                    do
+                    {
+                        nbytes = sendmsg(sock.fd(), &msg, MSG_NOSIGNAL);
+                    } while (nbytes == -1 && errno == EINTR);
+                    assert_throw(nbytes == sizeof(hello), "Failed to send shared memory handshake");
+                }
+                catch (...)
+                {
+                    unmap_ring(tx);
+                    unmap_ring(rx);
+                    close(fds[0]);
+                    close(fds[1]);
+                    throw;
+                }
+                close(fds[0]);
+                close(fds[1]);
+            }
+
+            /* Tells the other side the channel is closed and unmaps the rings */
+            ~SHM()
+            {
+                close_channel();
+            }
+
+            /* SHM should not be copied, since this is undefined behavior */
+            SHM(const SHM &obj) = delete;
+
+            /* SHM should not be copied, since this is undefined behavior */
+            auto operator=(const SHM &obj) -> SHM & = delete;
+
+            /* SHM move constructor */
+            SHM(SHM &&obj)
+                : side(obj.side), sock(std::move(obj.sock)), tx(std::exchange(obj.tx, Ring{})),
+                  rx(std::exchange(obj.rx, Ring{})), options(obj.options), rx_pending(std::exchange(obj.rx_pending, 0)),
+                  broken(std::exchange(obj.broken, false))
+            {
+            }
+
+            /* SHM move assignment, closes the channel currently held first */
+            auto operator=(SHM &&obj) -> SHM &
+            {
+                if (this == &obj)
+                {
+                    return *this;
+                }
+                close_channel();
+                side = obj.side;
+                sock = std::move(obj.sock);
+                tx = std::exchange(obj.tx, Ring{});
+                rx = std::exchange(obj.rx, Ring{});
+                options = obj.options;
+                rx_pending = std::exchange(obj.rx_pending, 0);
+                broken = std::exchange(obj.broken, false);
+                return *this;
+            }
+
+            /*  Waits for a client and completes its handshake. The client sends its rings straight after
+                connecting, so this only blocks until it has */
+            auto accept_connection() -> SHM
+            {
+                assert_throw(side == Side::SERVER, "Must accept connection from server");
+                return SHM(sock.accept_connection(), options);
+            }
+
+            /* Which end of the channel this is */
+            auto get_side() const -> Side
+            {
+                return side;
+            }
+
+            /* Bytes available to messages in each direction */
+            auto capacity() const -> std::size_t
+            {
+                return tx.cap;
+            }
+
+            /* Sends size bytes of msg as one message */
+            auto write_frame(const void *msg, const std::size_t size) -> void
+            {
+                std::memcpy(claim(size), msg, size);
+                publish(size);
+            }
+
+            /*  Waits for the next message, the view points into the ring and is only valid until the next read
+                from this channel */
+            auto read_frame() -> std::string_view
+            {
+                return *next_frame(true);
+            }
+
+            /*  Returns the next message if there is one without waiting. The view is only valid until the next
+                read from this channel */
+            auto poll_frame() -> std::optional<std::string_view>
+            {
+                return next_frame(false);
+            }
+
+            /*  Sends obj as one message. Vectors send all of their elements, strings are sent without their
+                terminator and any other trivially copyable object is sent as its bytes */
+            template <typename T> friend auto operator<<(SHM &shm, const std::vector<T> &obj) -> SHM &
+            {
+                static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be sent");
+                shm.write_frame(obj.data(), obj.size() * sizeof(T));
+                return shm;
+            }
+
+            friend auto operator<<(SHM &shm, const std::string &obj) -> SHM &
+            {
+                shm.write_frame(obj.data(), obj.size());
+                return shm;
+            }
+
+            template <typename T> friend auto operator<<(SHM &shm, const T &obj) -> SHM &
+            {
+                static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be sent");
+                shm.write_frame(&obj, sizeof(obj));
+                return shm;
+            }
+
+            /* Receives one message into obj, resized to the number of elements in it */
+            template <typename T> friend auto operator>>(SHM &shm, std::vector<T> &obj) -> SHM &
+            {
+                static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be received");
+                std::string_view frame = shm.read_frame();
+                assert_throw(frame.size() % sizeof(T) == 0, "Message is not a whole number of elements");
+                obj.resize(frame.size() / sizeof(T));
+                std::memcpy(obj.data(), frame.data(), frame.size());
+                return shm;
+            }
+
+            /* Replaces obj with the next message */
+            friend auto operator>>(SHM &shm, std::string &obj) -> SHM &
+            {
+                obj.assign(shm.read_frame());
+                return shm;
+            }
+
+            /* Receives one message into obj, the message must be exactly the size of the object */
+            template <typename T> friend auto operator>>(SHM &shm, T &obj) -> SHM &
+            {
+                static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be received");
+                std::string_view frame = shm.read_frame();
+                assert_throw(frame.size() == sizeof(obj), "Message does not match the size of the object");
+                std::memcpy(&obj, frame.data(), sizeof(obj));
+                return shm;
+            }
+    };
+} // namespace jj
+
+#endif
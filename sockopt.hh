@@ -0,0 +1,140 @@
+#ifndef SOCKOPT_HH
+#define SOCKOPT_HH
+
+#include <cerrno>
+#include <cstdint>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <type_traits>
+
+#include "common.hh"
+
+namespace jj
+{
+    /*  Typed socket options for TCP::set_option / UDP::set_option and their get_option counterparts. Each
+        option knows its level, name, value type and which kinds of socket it applies to, so setting a TCP
+        only option on a UDP socket or passing the wrong type fails to compile */
+    namespace sockopt
+    {
+        template <int Level, int Name, typename T, bool OnTCP, bool OnUDP> struct Option
+        {
+            using value_type = T;
+            static constexpr int level = Level;
+            static constexpr int name = Name;
+            static constexpr bool tcp = OnTCP;
+            static constexpr bool udp = OnUDP;
+        };
+
+        /* Sends small writes straight away instead of waiting to coalesce them (Nagle) */
+        using NoDelay = Option<IPPROTO_TCP, TCP_NODELAY, bool, true, false>;
+
+        /* Acks straight away instead of delaying, the kernel can turn it back off so set it after reads */
+        using QuickAck = Option<IPPROTO_TCP, TCP_QUICKACK, bool, true, false>;
+
+        /* Kernel send buffer size in bytes, the kernel doubles it and caps it at net.core.wmem_max */
+        using SendBuffer = Option<SOL_SOCKET, SO_SNDBUF, int, true, true>;
+
+        /* Kernel receive buffer size in bytes, the kernel doubles it and caps it at net.core.rmem_max */
+        using RecvBuffer = Option<SOL_SOCKET, SO_RCVBUF, int, true, true>;
+
+        /* Microseconds to busy poll the device queue on blocking reads, raising it needs CAP_NET_ADMIN */
+        using BusyPoll = Option<SOL_SOCKET, SO_BUSY_POLL, int, true, true>;
+
+        /* Unsent bytes allowed in the send buffer before the socket stops being writable */
+        using NotSentLowat = Option<IPPROTO_TCP, TCP_NOTSENT_LOWAT, int, true, false>;
+
+        /* Queueing priority for outgoing packets, 0 to 6 without CAP_NET_ADMIN */
+        using Priority = Option<SOL_SOCKET, SO_PRIORITY, int, true, true>;
+
+        /* IPv4 type of service byte, e.g. IPTOS_LOWDELAY or a DSCP value shifted left by 2 */
+        using TypeOfService = Option<IPPROTO_IP, IP_TOS, int, true, true>;
+
+        /* IPv6 traffic class byte, the IPv6 counterpart of TypeOfService */
+        using TrafficClass = Option<IPPROTO_IPV6, IPV6_TCLASS, int, true, true>;
+
+        /* Upper limit on the sending rate in bytes per second, enforced by TCP pacing or the fq qdisc */
+        using MaxPacingRate = Option<SOL_SOCKET, SO_MAX_PACING_RATE, std::uint64_t, true, true>;
+
+        /* Named combinations of options tuned for one goal */
+        enum Profile
+        {
+            /* Small request/response messages: no Nagle, immediate acks, a short unsent queue, busy polling
+                where allowed and interactive priority */
+            LATENCY,
+
+            /* Bulk transfers: Nagle on and large kernel buffers */
+            THROUGHPUT
+        };
+
+        /* Sets option O on fd, the value is passed to the kernel as an int unless the option is wider */
+        template <typename O> inline auto set(const int fd, const typename O::value_type value) -> int
+        {
+            using T = typename O::value_type;
+            using Raw = std::conditional_t<(sizeof(T) > sizeof(int)), T, int>;
+            Raw raw = static_cast<Raw>(value);
+            return setsockopt(fd, O::level, O::name, &raw, sizeof(raw));
+        }
+
+        /* Reads option O from fd */
+        template <typename O> inline auto get(const int fd) -> typename O::value_type
+        {
+            using T = typename O::value_type;
+            using Raw = std::conditional_t<(sizeof(T) > sizeof(int)), T, int>;
+            Raw raw = 0;
+            socklen_t len = sizeof(raw);
+            int ret = getsockopt(fd, O::level, O::name, &raw, &len);
+            assert_throw(ret != -1, "Failed to get socket option");
+            return static_cast<T>(raw);
+        }
+
+        /*  Applies profile to fd, a socket of the given address family. Options that need privileges the process
+            does not have are skipped, anything else that fails throws. Unix sockets only get the socket level
+            options */
+        inline auto apply(const int fd, const Profile profile, const sa_family_t family, const bool is_tcp) -> void
+        {
+            auto best_effort = [](int ret)
+            { assert_throw(ret != -1 || errno == EPERM || errno == EACCES, "Failed to apply socket profile"); };
+
+            /*  IPv6 sockets mark native packets with the traffic class and v4-mapped ones with the type of
+                service, so both are set there */
+            auto set_tos = [&](int tos)
+            {
+                if (family == AF_INET || family == AF_INET6)
+                {
+                    best_effort(set<TypeOfService>(fd, tos));
+                }
+                if (family == AF_INET6)
+                {
+                    best_effort(set<TrafficClass>(fd, tos));
+                }
+            };
+
+            if (profile == LATENCY)
+            {
+                if (is_tcp && family != AF_UNIX)
+                {
+                    best_effort(set<NoDelay>(fd, true));
+                    best_effort(set<QuickAck>(fd, true));
+                    best_effort(set<NotSentLowat>(fd, 16 << 10));
+                }
+                best_effort(set<BusyPoll>(fd, 50));
+                best_effort(set<Priority>(fd, 6));
+                set_tos(IPTOS_LOWDELAY);
+            }
+            else
+            {
+                if (is_tcp && family != AF_UNIX)
+                {
+                    best_effort(set<NoDelay>(fd, false));
+                }
+                best_effort(set<SendBuffer>(fd, 4 << 20));
+                best_effort(set<RecvBuffer>(fd, 4 << 20));
+                set_tos(IPTOS_THROUGHPUT);
+            }
+        }
+    } // namespace sockopt
+} // namespace jj
+
+#endif
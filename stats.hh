@@ -0,0 +1,425 @@
+#ifndef STATS_HH
+#define STATS_HH
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace jj
+{
+    /*  A log-linear latency histogram in nanoseconds, every power of two is split into 16 linear buckets so
+        values are kept to within about 6% of what was recorded. Recording is two relaxed atomic stores, it
+        assumes a single thread records while any number of threads read */
+    class Histogram
+    {
+        public:
+            static constexpr int SUB_BITS = 4;
+            static constexpr int SUB_COUNT = 1 << SUB_BITS;
+
+            /* Values from 2^MAX_BITS ns (about 18 minutes) up land in the last bucket */
+            static constexpr int MAX_BITS = 40;
+            static constexpr std::size_t BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
+
+        private:
+            std::array<std::atomic<std::uint64_t>, BUCKETS> counts = {};
+            std::atomic<std::uint64_t> total = 0;
+            std::atomic<std::uint64_t> largest = 0;
+
+            static auto bump(std::atomic<std::uint64_t> &value, const std::uint64_t by) -> void
+            {
+                value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+            }
+
+        public:
+            Histogram() = default;
+
+            /* Copies the current counts, used for snapshots */
+            Histogram(const Histogram &obj)
+            {
+                *this = obj;
+            }
+
+            /* Copies the current counts, used for snapshots */
+            auto operator=(const Histogram &obj) -> Histogram &
+            {
+                for (std::size_t i = 0; i < BUCKETS; ++i)
+                {
+                    counts[i].store(obj.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                }
+                total.store(obj.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                largest.store(obj.largest.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                return *this;
+            }
+
+            /* The bucket value falls into */
+            static constexpr auto bucket(const std::uint64_t value) -> std::size_t
+            {
+                if (value < SUB_COUNT)
+                {
+                    return value;
+                }
+                int shift = std::bit_width(value) - 1 - SUB_BITS;
+                std::size_t index = ((shift + 1) << SUB_BITS) + ((value >> shift) & (SUB_COUNT - 1));
+                return index < BUCKETS ? index : BUCKETS - 1;
+            }
+
+            /* The largest value that falls into bucket index */
+            static constexpr auto upper_bound(const std::size_t index) -> std::uint64_t
+            {
+                if (index < SUB_COUNT)
+                {
+                    return index;
+                }
+                int shift = (index >> SUB_BITS) - 1;
+                std::uint64_t low = (SUB_COUNT + (index & (SUB_COUNT - 1))) << shift;
+                return low + (std::uint64_t{1} << shift) - 1;
+            }
+
+            /* Adds one value */
+            auto record(const std::uint64_t value) -> void
+            {
+                bump(counts[bucket(value)], 1);
+                bump(total, 1);
+                if (value > largest.load(std::memory_order_relaxed))
+                {
+                    largest.store(value, std::memory_order_relaxed);
+                }
+            }
+
+            /* Adds every value recorded in other */
+            auto merge(const Histogram &other) -> void
+            {
+                for (std::size_t i = 0; i < BUCKETS; ++i)
+                {
+                    bump(counts[i], other.counts[i].load(std::memory_order_relaxed));
+                }
+                bump(total, other.total.load(std::memory_order_relaxed));
+                if (other.max() > max())
+                {
+                    largest.store(other.max(), std::memory_order_relaxed);
+                }
+            }
+
+            /* Number of values recorded */
+            auto count() const -> std::uint64_t
+            {
+                return total.load(std::memory_order_relaxed);
+            }
+
+            /* Largest value recorded, exact rather than rounded to a bucket */
+            auto max() const -> std::uint64_t
+            {
+                return largest.load(std::memory_order_relaxed);
+            }
+
+            /* The value at percentile p (0 to 1), as the upper bound of its bucket, 0 when empty */
+            auto percentile(const double p) const -> std::uint64_t
+            {
+                std::uint64_t rank = p * count();
+                std::uint64_t seen = 0;
+                for (std::size_t i = 0; i < BUCKETS; ++i)
+                {
+                    seen += counts[i].load(std::memory_order_relaxed);
+                    if (seen > rank)
+                    {
+                        return i == BUCKETS - 1 ? max() : std::min(upper_bound(i), max());
+                    }
+                }
+                return max();
+            }
+    };
+
+    class StatsRegistry;
+
+    /*  Counters kept by TCP and UDP sockets when the program is built with JJ_SOCKET_STATS defined. Without it
+        the class is empty and every hook compiles down to the bare syscall, so instrumentation costs nothing
+        unless asked for. Messages are syscalls that moved data, one per datagram for UDP, short reads and writes
+        are stream syscalls that moved less than asked for, and the time spent in send and recv is wall time
+        inside the syscall, which for blocking sockets is the time spent blocked */
+    class SocketStats
+    {
+        public:
+            enum Kind
+            {
+                TCP,
+                UDP
+            };
+
+            /* Everything counted for one socket, copied out at one point in time */
+            struct Snapshot
+            {
+                Kind kind;
+                int fd;
+                std::uint64_t bytes_sent;
+                std::uint64_t bytes_received;
+                std::uint64_t messages_sent;
+                std::uint64_t messages_received;
+                std::uint64_t syscalls;
+                std::uint64_t short_writes;
+                std::uint64_t short_reads;
+                std::uint64_t eagain;
+                std::uint64_t eintr;
+                std::uint64_t send_ns;
+                std::uint64_t recv_ns;
+                Histogram send_latency;
+                Histogram recv_latency;
+            };
+
+#ifdef JJ_SOCKET_STATS
+        private:
+            friend class StatsRegistry;
+
+            struct Counters
+            {
+                Kind kind;
+                std::atomic<int> fd = -1;
+                std::atomic<std::uint64_t> bytes_sent = 0;
+                std::atomic<std::uint64_t> bytes_received = 0;
+                std::atomic<std::uint64_t> messages_sent = 0;
+                std::atomic<std::uint64_t> messages_received = 0;
+                std::atomic<std::uint64_t> syscalls = 0;
+                std::atomic<std::uint64_t> short_writes = 0;
+                std::atomic<std::uint64_t> short_reads = 0;
+                std::atomic<std::uint64_t> eagain = 0;
+                std::atomic<std::uint64_t> eintr = 0;
+                std::atomic<std::uint64_t> send_ns = 0;
+                std::atomic<std::uint64_t> recv_ns = 0;
+                Histogram send_latency;
+                Histogram recv_latency;
+
+                explicit Counters(const Kind kind) : kind(kind)
+                {
+                }
+
+                auto snapshot() const -> Snapshot
+                {
+                    auto get = [](const std::atomic<std::uint64_t> &value)
+                    { return value.load(std::memory_order_relaxed); };
+                    return Snapshot{kind,
+                                    fd.load(std::memory_order_relaxed),
+                                    get(bytes_sent),
+                                    get(bytes_received),
+                                    get(messages_sent),
+                                    get(messages_received),
+                                    get(syscalls),
+                                    get(short_writes),
+                                    get(short_reads),
+                                    get(eagain),
+                                    get(eintr),
+                                    get(send_ns),
+                                    get(recv_ns),
+                                    send_latency,
+                                    recv_latency};
+                }
+            };
+
+            /*  Heap allocated so the registry keeps pointing at it when the socket is moved. Null once moved
+                from, until the socket is used again */
+            Kind kind;
+            std::unique_ptr<Counters> counters;
+
+            /* The counters, starting fresh ones if they were moved to another socket */
+            auto live() -> Counters &;
+
+            static auto bump(std::atomic<std::uint64_t> &value, const std::uint64_t by = 1) -> void
+            {
+                value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+            }
+
+            /* Times call and counts its outcome, errno is left as the syscall set it */
+            template <typename Call>
+            auto measure(const bool sending, const std::size_t requested, Call &&call) -> decltype(call())
+            {
+                auto begin = std::chrono::steady_clock::now();
+                auto nbytes = call();
+                int err = errno;
+                std::uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                            std::chrono::steady_clock::now() - begin)
+                                            .count();
+
+                Counters &c = live();
+                bump(c.syscalls);
+                bump(sending ? c.send_ns : c.recv_ns, elapsed);
+                (sending ? c.send_latency : c.recv_latency).record(elapsed);
+                if (nbytes == -1 && err == EINTR)
+                {
+                    bump(c.eintr);
+                }
+                else if (nbytes == -1 && (err == EAGAIN || err == EWOULDBLOCK))
+                {
+                    bump(c.eagain);
+                }
+                else if (nbytes > 0)
+                {
+                    bump(sending ? c.bytes_sent : c.bytes_received, nbytes);
+                    bump(sending ? c.messages_sent : c.messages_received);
+                    if (c.kind == TCP && static_cast<std::size_t>(nbytes) < requested)
+                    {
+                        bump(sending ? c.short_writes : c.short_reads);
+                    }
+                }
+                errno = err;
+                return nbytes;
+            }
+
+        public:
+            explicit SocketStats(const Kind kind);
+            ~SocketStats();
+            SocketStats(SocketStats &&obj);
+            auto operator=(SocketStats &&obj) -> SocketStats &;
+
+            /* Records the descriptor the counters belong to, shown in snapshots */
+            auto set_fd(const int fd) -> void
+            {
+                live().fd.store(fd, std::memory_order_relaxed);
+            }
+
+            /*  Runs call, a send like syscall asked to move requested bytes, and counts the result. Returns what
+                call returned */
+            template <typename Call> auto send(const std::size_t requested, Call &&call) -> decltype(call())
+            {
+                return measure(true, requested, call);
+            }
+
+            /* Same as send for recv like syscalls */
+            template <typename Call> auto recv(const std::size_t requested, Call &&call) -> decltype(call())
+            {
+                return measure(false, requested, call);
+            }
+
+            /* The counters of this socket right now, all zero for a socket that was moved from */
+            auto snapshot() const -> Snapshot
+            {
+                if (!counters)
+                {
+                    Snapshot empty = {};
+                    empty.kind = kind;
+                    empty.fd = -1;
+                    return empty;
+                }
+                return counters->snapshot();
+            }
+#else
+        public:
+            explicit SocketStats(const Kind)
+            {
+            }
+
+            auto set_fd(const int) -> void
+            {
+            }
+
+            template <typename Call> auto send(const std::size_t, Call &&call) -> decltype(call())
+            {
+                return call();
+            }
+
+            template <typename Call> auto recv(const std::size_t, Call &&call) -> decltype(call())
+            {
+                return call();
+            }
+#endif
+    };
+
+    /*  Every live socket's counters, for dumping them all at once, e.g. from a signal handler thread or an admin
+        endpoint. Empty unless built with JJ_SOCKET_STATS */
+    class StatsRegistry
+    {
+#ifdef JJ_SOCKET_STATS
+        private:
+            friend class SocketStats;
+
+            std::mutex mutex;
+            std::unordered_set<SocketStats::Counters *> live;
+
+            auto add(SocketStats::Counters *counters) -> void
+            {
+                std::lock_guard lock(mutex);
+                live.insert(counters);
+            }
+
+            auto remove(SocketStats::Counters *counters) -> void
+            {
+                std::lock_guard lock(mutex);
+                live.erase(counters);
+            }
+#endif
+
+        public:
+            /* The registry every socket in the process reports to */
+            static auto instance() -> StatsRegistry &
+            {
+                static StatsRegistry registry;
+                return registry;
+            }
+
+            /* The counters of every live socket */
+            auto snapshot() -> std::vector<SocketStats::Snapshot>
+            {
+                std::vector<SocketStats::Snapshot> all;
+#ifdef JJ_SOCKET_STATS
+                std::lock_guard lock(mutex);
+                all.reserve(live.size());
+                for (SocketStats::Counters *counters : live)
+                {
+                    all.push_back(counters->snapshot());
+                }
+#endif
+                return all;
+            }
+    };
+
+#ifdef JJ_SOCKET_STATS
+    inline SocketStats::SocketStats(const Kind kind) : kind(kind), counters(std::make_unique<Counters>(kind))
+    {
+        StatsRegistry::instance().add(counters.get());
+    }
+
+    inline SocketStats::~SocketStats()
+    {
+        if (counters)
+        {
+            StatsRegistry::instance().remove(counters.get());
+        }
+    }
+
+    inline auto SocketStats::live() -> Counters &
+    {
+        if (!counters)
+        {
+            counters = std::make_unique<Counters>(kind);
+            StatsRegistry::instance().add(counters.get());
+        }
+        return *counters;
+    }
+
+    inline SocketStats::SocketStats(SocketStats &&obj) : kind(obj.kind), counters(std::move(obj.counters))
+    {
+    }
+
+    inline auto SocketStats::operator=(SocketStats &&obj) -> SocketStats &
+    {
+        if (this != &obj)
+        {
+            if (counters)
+            {
+                StatsRegistry::instance().remove(counters.get());
+            }
+            kind = obj.kind;
+            counters = std::move(obj.counters);
+        }
+        return *this;
+    }
+#endif
+} // namespace jj
+
+#endif
@@ -3,36 +3,51 @@
 
 #include <algorithm>
 #include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <exception>
+#include <expected>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <span>
 #include <stdexcept>
+#include <poll.h>
 #include <string>
+#include <string_view>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <type_traits>
+#include <utility>
 #include <unistd.h>
 #include <vector>
 
+#include "common.hh"
+#include "endpoint.hh"
+#include "ring.hh"
+#include "sockopt.hh"
+#include "stats.hh"
+
 namespace jj
 {
-    /* Helper to use assert like syntax to throw an error */
-    inline auto assert_throw(bool condition, const std::string &msg) -> void
-    {
-        if (condition == false)
-        {
-            throw std::runtime_error(msg);
-        }
-    }
-
-    /* Helper to load a string into a vector */
-    inline auto operator<<(std::vector<char> &vec, const std::string str) -> std::vector<char> &
-    {
-        std::copy(str.begin(), str.end() + 1, vec.begin());
-        return vec;
-    }
+    class Uring;
 
     /*  A header only wrapper around the C-Style TCP Socket API. */
     class TCP
     {
+            friend class Uring;
+
         public:
             enum Side
             {
@@ -41,49 +56,619 @@ namespace jj
                 CONNECTION
             };
 
+            /*  How messages are delimited on the stream. RAW sends objects as they are, LENGTH_PREFIXED puts a
+                varint length in front of every object so each read returns exactly one message */
+            enum Framing
+            {
+                RAW,
+                LENGTH_PREFIXED
+            };
+
+            /* Settings that have to be in place before the socket is bound or connected */
+            struct Options
+            {
+                /* Connections queued by a server before new ones are dropped */
+                int backlog = SOMAXCONN;
+
+                /* Lets a restarted server bind while old connections are still in TIME_WAIT */
+                bool reuse_addr = true;
+
+                /* Lets several servers bind the same port, the kernel spreads connections between them */
+                bool reuse_port = false;
+
+                /*  TCP Fast Open. On a server this is the number of pending fast open connections allowed, on a
+                    client any non zero value makes the first write go out with the SYN instead of after the
+                    handshake. 0 turns it off. Needs net.ipv4.tcp_fastopen to allow it (1 for clients, 2 for
+                    servers, 3 for both) */
+                int fast_open = 0;
+
+                /*  Unix endpoints only, use SOCK_SEQPACKET instead of SOCK_STREAM so every write arrives as one
+                    message and a read never returns more than one */
+                bool seqpacket = false;
+            };
+
+            /*  A typed copy of the kernel's TCP_INFO for one connection. Fields the running kernel does not
+                report yet are left at zero */
+            struct Info
+            {
+                /* TCP_ESTABLISHED, TCP_CLOSE_WAIT, ... */
+                std::uint8_t state;
+
+                /* Congestion avoidance state, 0 (open) when nothing is wrong, see TCP_CA_* */
+                std::uint8_t ca_state;
+
+                /* Smoothed round trip time, its variation, the lowest seen and the retransmit timeout */
+                std::chrono::microseconds rtt;
+                std::chrono::microseconds rttvar;
+                std::chrono::microseconds min_rtt;
+                std::chrono::microseconds rto;
+
+                /* Congestion window and slow start threshold in segments, and the segment size in bytes */
+                std::uint32_t snd_cwnd;
+                std::uint32_t snd_ssthresh;
+                std::uint32_t snd_mss;
+
+                /* Timeouts in a row without progress, and every retransmitted segment so far */
+                std::uint32_t retransmits;
+                std::uint32_t total_retrans;
+
+                /* Segments sent but not acked, and of those the ones thought lost */
+                std::uint32_t unacked;
+                std::uint32_t lost;
+
+                /* Recent delivery rate and pacing rate in bytes per second */
+                std::uint64_t delivery_rate;
+                std::uint64_t pacing_rate;
+
+                /* Lifetime byte counts */
+                std::uint64_t bytes_acked;
+                std::uint64_t bytes_received;
+                std::uint64_t bytes_sent;
+                std::uint64_t bytes_retrans;
+
+                /* Bytes written by the application that have not been sent yet */
+                std::uint32_t notsent_bytes;
+            };
+
         private:
             int sock_fd;
-            struct sockaddr_in sock_conf;
+            struct sockaddr_storage sock_conf;
             socklen_t sock_conf_len;
             Side side;
+            bool nonblocking = false;
+            std::size_t backlog_size = 0;
+
+            /* Receive side of the framed mode, frames are parsed out of rx_buf[rx_begin, rx_end) */
+            Framing framing = Framing::RAW;
+            std::size_t max_frame = 0;
+            std::vector<char> rx_buf;
+            std::size_t rx_begin = 0;
+            std::size_t rx_end = 0;
+
+            /* Send side of the buffered mode, writes collect in tx_buf until flushed */
+            std::vector<char> tx_buf;
+            std::size_t tx_used = 0;
+            std::chrono::steady_clock::duration tx_delay{};
+            std::chrono::steady_clock::time_point tx_since;
+
+            /* Timeout given to blocking reads and writes that have no deadline of their own, zero waits forever */
+            std::chrono::steady_clock::duration io_timeout{};
+
+            /* How long closing a socket waits to send what is still buffered when set_timeout was not used */
+            static constexpr std::chrono::seconds CLOSE_TIMEOUT{5};
+
+            /*  MSG_ZEROCOPY state, zc_next is the id the kernel gives the next zerocopy send and every id below
+                zc_done has completed. Completions that arrive out of order wait in zc_early */
+            std::size_t zc_threshold = 0;
+            std::uint32_t zc_next = 0;
+            std::uint32_t zc_done = 0;
+            std::size_t zc_copied = 0;
+            std::vector<std::pair<std::uint32_t, std::uint32_t>> zc_early;
+
+            /*  The kernel's struct tcp_info, glibc's copy stops at tcpi_total_retrans so the newer fields are
+                spelled out here. The kernel only ever appends to it and fills in as much as both sides know */
+            struct RawInfo
+            {
+                struct tcp_info base;
+                std::uint64_t pacing_rate;
+                std::uint64_t max_pacing_rate;
+                std::uint64_t bytes_acked;
+                std::uint64_t bytes_received;
+                std::uint32_t segs_out;
+                std::uint32_t segs_in;
+                std::uint32_t notsent_bytes;
+                std::uint32_t min_rtt;
+                std::uint32_t data_segs_in;
+                std::uint32_t data_segs_out;
+                std::uint64_t delivery_rate;
+                std::uint64_t busy_time;
+                std::uint64_t rwnd_limited;
+                std::uint64_t sndbuf_limited;
+                std::uint32_t delivered;
+                std::uint32_t delivered_ce;
+                std::uint64_t bytes_sent;
+                std::uint64_t bytes_retrans;
+            };
+            static_assert(offsetof(RawInfo, pacing_rate) == 104, "Unexpected struct tcp_info layout");
+
+            /* Hot path counters, empty unless built with JJ_SOCKET_STATS */
+            [[no_unique_address]] SocketStats stats{SocketStats::TCP};
+
+            /* Bytes described by the first iovcnt entries of iov */
+            static auto iov_bytes(const struct iovec *iov, const int iovcnt) -> std::size_t
+            {
+                std::size_t total = 0;
+                for (int i = 0; i < iovcnt; ++i)
+                {
+                    total += iov[i].iov_len;
+                }
+                return total;
+            }
+
+            /* Closes the socket, a server on a Unix socket path also removes its socket file */
+            auto close_socket() -> void
+            {
+                if (side == Side::SERVER && sock_conf.ss_family == AF_UNIX)
+                {
+                    Endpoint((const struct sockaddr *)&sock_conf, sock_conf_len).unlink_socket();
+                }
+                close(sock_fd);
+            }
 
             /* Used internally to create a new TCP instance for an accepted connection */
-            TCP(int sock_fd) : sock_fd(sock_fd), sock_conf_len(-1), side(Side::CONNECTION)
+            TCP(int sock_fd, const struct sockaddr_storage &peer, bool nonblocking)
+                : sock_fd(sock_fd), sock_conf(peer), sock_conf_len(sizeof(peer)), side(Side::CONNECTION),
+                  nonblocking(nonblocking)
+            {
+                stats.set_fd(sock_fd);
+            }
+
+            /*  Accepts one pending connection, flags are passed straight to accept4. Returns -1 when there is
+                nothing left in the backlog */
+            auto accept_one(struct sockaddr_storage &peer, int flags) -> int
+            {
+                while (true)
+                {
+                    socklen_t peer_len = sizeof(peer);
+                    int new_sock = accept4(sock_fd, (struct sockaddr *)&peer, &peer_len, flags);
+                    if (new_sock != -1)
+                    {
+                        return new_sock;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        return -1;
+                    }
+                    /* The connection died while in the backlog or the call was interrupted, try the next one */
+                    if (errno != EINTR && errno != ECONNABORTED && errno != EPROTO)
+                    {
+                        assert_throw(false, "Failed to accept connection");
+                    }
+                }
+            }
+
+            /*  Waits until the socket is ready for events, used to give non-blocking sockets blocking semantics.
+                Throws TimeoutError once deadline passes */
+            auto wait_ready(short events, const std::chrono::steady_clock::time_point deadline = NO_DEADLINE) -> void
+            {
+                if (!wait_fd(sock_fd, events, deadline))
+                {
+                    if (errno == ETIMEDOUT)
+                    {
+                        throw_io_error(events & POLLOUT);
+                    }
+                    assert_throw(false, "Failed to wait for socket");
+                }
+            }
+
+            /* The deadline of a read or write starting now that was not given one, from set_timeout */
+            auto default_deadline() const -> std::chrono::steady_clock::time_point
+            {
+                if (io_timeout == std::chrono::steady_clock::duration::zero())
+                {
+                    return NO_DEADLINE;
+                }
+                return std::chrono::steady_clock::now() + io_timeout;
+            }
+
+            /*  Runs call, a send or recv like syscall given extra flags, until it moves data or fails with
+                something other than EINTR or EAGAIN, waiting for the socket in between. Without a deadline a
+                blocking socket simply blocks inside the syscall. With one the syscall gets MSG_DONTWAIT and only
+                poll waits, so a deadline costs nothing when data or room is already there. Returns what call
+                returned, -1 with errno set to ETIMEDOUT once the deadline passes */
+            template <typename Call>
+            auto io_until(const bool sending, const std::size_t requested,
+                          const std::chrono::steady_clock::time_point deadline, Call &&call) -> ssize_t
+            {
+                int extra = deadline == NO_DEADLINE ? 0 : MSG_DONTWAIT;
+                while (true)
+                {
+                    ssize_t nbytes = sending ? stats.send(requested, [&] { return call(extra); })
+                                             : stats.recv(requested, [&] { return call(extra); });
+                    if (nbytes != -1)
+                    {
+                        return nbytes;
+                    }
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+                        !wait_fd(sock_fd, sending ? POLLOUT : POLLIN, deadline))
+                    {
+                        return -1;
+                    }
+                }
+            }
+
+            /* Throws for a read or write that failed with errno, a passed deadline as a TimeoutError */
+            [[noreturn]] static auto throw_io_error(const bool writing) -> void
+            {
+                if (errno == ETIMEDOUT)
+                {
+                    throw TimeoutError(writing ? "Timed out writing to socket" : "Timed out reading from socket");
+                }
+                throw std::runtime_error(writing ? "Failed to write to socket" : "Failed to read from socket");
+            }
+
+            /*  Sends every byte described by iov in as few sendmsg calls as possible, carrying on after short
+                writes and EINTR. flags are added to every sendmsg, and MSG_MORE to every one but the last when
+                iov is too long for a single call. iov is modified to track progress, what was sent before a
+                timeout is gone */
+            auto transmit(struct iovec *iov, int iovcnt, int flags,
+                          const std::chrono::steady_clock::time_point deadline) -> void
+            {
+                struct msghdr msg = {};
+                while (iovcnt > 0)
+                {
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = std::min(iovcnt, IOV_MAX);
+                    int more = iovcnt > IOV_MAX ? MSG_MORE : 0;
+                    auto call = [&](int extra) { return sendmsg(sock_fd, &msg, MSG_NOSIGNAL | flags | more | extra); };
+                    ssize_t nbytes = io_until(true, iov_bytes(iov, msg.msg_iovlen), deadline, call);
+                    if (nbytes == -1)
+                    {
+                        throw_io_error(true);
+                    }
+
+                    while (iovcnt > 0 && static_cast<std::size_t>(nbytes) >= iov->iov_len)
+                    {
+                        nbytes -= iov->iov_len;
+                        ++iov;
+                        --iovcnt;
+                    }
+                    if (iovcnt > 0)
+                    {
+                        iov->iov_base = static_cast<char *>(iov->iov_base) + nbytes;
+                        iov->iov_len -= nbytes;
+                    }
+                }
+            }
+
+            /*  Every write goes through here. Unbuffered sockets transmit straight away, buffered ones copy into
+                tx_buf and only transmit when it fills up or the oldest byte is older than the flush delay. iov is
+                modified to track progress */
+            auto send_all_iov(struct iovec *iov, int iovcnt, const std::chrono::steady_clock::time_point deadline)
+                -> void
+            {
+                assert_throw(side != Side::SERVER, "Can not write to server socket");
+                if (tx_buf.empty())
+                {
+                    transmit(iov, iovcnt, 0, deadline);
+                    return;
+                }
+
+                std::size_t total = 0;
+                for (int i = 0; i < iovcnt; ++i)
+                {
+                    total += iov[i].iov_len;
+                }
+
+                if (tx_used + total <= tx_buf.size())
+                {
+                    if (tx_used == 0)
+                    {
+                        tx_since = std::chrono::steady_clock::now();
+                    }
+                    for (int i = 0; i < iovcnt; ++i)
+                    {
+                        std::memcpy(tx_buf.data() + tx_used, iov[i].iov_base, iov[i].iov_len);
+                        tx_used += iov[i].iov_len;
+                    }
+                    if (tx_delay != std::chrono::steady_clock::duration::zero())
+                    {
+                        flush_if_due();
+                    }
+                    return;
+                }
+
+                /*  The buffer is full, send it together with the new data. When that takes two sends MSG_MORE
+                    keeps the first from leaving as a partial segment. The last one goes out without it, since
+                    nothing is left in the buffer for a later flush to push the held back tail with */
+                struct iovec gathered[Batch::MAX_IOV + 1];
+                if (iovcnt <= Batch::MAX_IOV)
+                {
+                    gathered[0] = {tx_buf.data(), tx_used};
+                    std::copy(iov, iov + iovcnt, gathered + 1);
+                    tx_used = 0;
+                    transmit(gathered, iovcnt + 1, 0, deadline);
+                    return;
+                }
+                struct iovec pending = {tx_buf.data(), tx_used};
+                tx_used = 0;
+                transmit(&pending, 1, MSG_MORE, deadline);
+                transmit(iov, iovcnt, 0, deadline);
+            }
+
+            /* Records that zerocopy sends lo through hi (inclusive) no longer reference their buffers */
+            auto complete_zerocopy(std::uint32_t lo, std::uint32_t hi) -> void
+            {
+                if (lo != zc_done)
+                {
+                    zc_early.emplace_back(lo, hi);
+                    return;
+                }
+                zc_done = hi + 1;
+                for (auto it = zc_early.begin(); it != zc_early.end();)
+                {
+                    if (it->first == zc_done)
+                    {
+                        zc_done = it->second + 1;
+                        zc_early.erase(it);
+                        it = zc_early.begin();
+                        continue;
+                    }
+                    ++it;
+                }
+            }
+
+            /*  Sends what is still buffered before the socket is closed or replaced. There may be nobody left to
+                deliver it to, so failures are ignored and the wait is bounded by the socket's timeout, or by
+                CLOSE_TIMEOUT without one */
+            auto flush_before_close() -> void
+            {
+                if (tx_used == 0 || sock_fd == -1)
+                {
+                    return;
+                }
+                auto timeout = io_timeout == std::chrono::steady_clock::duration::zero() ? CLOSE_TIMEOUT : io_timeout;
+                struct iovec iov = {tx_buf.data(), tx_used};
+                tx_used = 0;
+                try
+                {
+                    transmit(&iov, 1, 0, std::chrono::steady_clock::now() + timeout);
+                }
+                catch (const std::runtime_error &)
+                {
+                    /* The peer is gone or stuck, the data can not be delivered */
+                }
+            }
+
+            /* Pushes out buffered writes before a read, so a request is never stuck behind its own response */
+            auto flush_pending() -> void
+            {
+                if (tx_used != 0)
+                {
+                    flush();
+                }
+            }
+
+            /*  flush_pending for the try_ API, failed sends come back as their errno. It never waits, not even on
+                a blocking socket, so a full send buffer gives EAGAIN. Whatever a short send leaves behind stays
+                buffered and the next call carries on where it stopped */
+            auto try_flush_pending() -> std::error_code
+            {
+                while (tx_used != 0)
+                {
+                    ssize_t nbytes = stats.send(
+                        tx_used, [&] { return send(sock_fd, tx_buf.data(), tx_used, MSG_NOSIGNAL | MSG_DONTWAIT); });
+                    if (nbytes == -1)
+                    {
+                        if (errno == EINTR)
+                        {
+                            continue;
+                        }
+                        return std::error_code(errno, std::system_category());
+                    }
+                    std::memmove(tx_buf.data(), tx_buf.data() + nbytes, tx_used - nbytes);
+                    tx_used -= nbytes;
+                }
+                return {};
+            }
+
+            /* Writes len as a LEB128 varint into out, returns the number of bytes used (at most 10) */
+            static auto encode_length(std::uint64_t len, unsigned char *out) -> std::size_t
+            {
+                std::size_t used = 0;
+                while (len >= 0x80)
+                {
+                    out[used++] = static_cast<unsigned char>(len) | 0x80;
+                    len >>= 7;
+                }
+                out[used++] = static_cast<unsigned char>(len);
+                return used;
+            }
+
+            /*  Reads a LEB128 varint from the first avail bytes of in, returns the number of bytes used or 0 if
+                the header is not complete yet */
+            static auto decode_length(const char *in, std::size_t avail, std::uint64_t &len) -> std::size_t
+            {
+                len = 0;
+                for (std::size_t i = 0; i < avail; ++i)
+                {
+                    assert_throw(i < 10, "Malformed frame header");
+                    auto byte = static_cast<unsigned char>(in[i]);
+                    len |= static_cast<std::uint64_t>(byte & 0x7f) << (7 * i);
+                    if ((byte & 0x80) == 0)
+                    {
+                        return i + 1;
+                    }
+                }
+                return 0;
+            }
+
+            /*  Pulls whatever the kernel has into the frame buffer, making room for at least need more bytes
+                first. Returns false if nothing arrived before deadline, which may already have passed */
+            auto fill_frames(std::size_t need, const std::chrono::steady_clock::time_point deadline) -> bool
+            {
+                flush_pending();
+                if (rx_buf.size() - rx_end < need)
+                {
+                    std::copy(rx_buf.begin() + rx_begin, rx_buf.begin() + rx_end, rx_buf.begin());
+                    rx_end -= rx_begin;
+                    rx_begin = 0;
+                    if (rx_buf.size() - rx_end < need)
+                    {
+                        rx_buf.resize(std::max(rx_buf.size() * 2, rx_end + need));
+                    }
+                }
+
+                std::size_t room = rx_buf.size() - rx_end;
+                char *end = rx_buf.data() + rx_end;
+                ssize_t nbytes =
+                    io_until(false, room, deadline, [&](int extra) { return recv(sock_fd, end, room, extra); });
+                if (nbytes == -1 && errno == ETIMEDOUT)
+                {
+                    return false;
+                }
+                if (nbytes == -1)
+                {
+                    throw_io_error(false);
+                }
+                assert_throw(nbytes != 0, "Connection closed by peer");
+                rx_end += nbytes;
+                return true;
+            }
+
+            /*  Returns the next complete frame, reading from the socket only when the buffer runs dry. Empty if
+                no frame was complete by deadline. The view is valid until the next read */
+            auto next_frame(const std::chrono::steady_clock::time_point deadline) -> std::optional<std::string_view>
             {
-                std::fill((std::byte *)&sock_conf, (std::byte *)&sock_conf + sizeof(sock_conf), std::byte{0});
+                assert_throw(side != Side::SERVER, "Can not read from server socket");
+                assert_throw(framing == Framing::LENGTH_PREFIXED, "Socket is not in framed mode");
+                while (true)
+                {
+                    std::uint64_t len;
+                    std::size_t header = decode_length(rx_buf.data() + rx_begin, rx_end - rx_begin, len);
+                    std::size_t need = 1;
+                    if (header != 0)
+                    {
+                        assert_throw(len <= max_frame, "Frame is larger than the maximum frame size");
+                        if (rx_end - rx_begin >= header + len)
+                        {
+                            std::string_view frame(rx_buf.data() + rx_begin + header, len);
+                            rx_begin += header + len;
+                            if (rx_begin == rx_end)
+                            {
+                                rx_begin = rx_end = 0;
+                            }
+                            return frame;
+                        }
+                        need = header + len - (rx_end - rx_begin);
+                    }
+                    if (!fill_frames(need, deadline))
+                    {
+                        return std::nullopt;
+                    }
+                }
             }
 
         public:
-            /*  Create a new TCP object, if ip_addr is empty then a server will create, otherwise a client will
-                be created. */
-            TCP(const std::string ip_addr, const std::string port, const Side &side) : side(side)
+            /*  Create a new TCP object, a server listens on ip_addr (every IPv4 address if it is empty) and a
+                client connects to it. A server starts listening straight away, backlog connections will be
+                queued before connections are dropped. */
+            TCP(const std::string ip_addr, const std::string port, const Side &side, const int backlog = SOMAXCONN)
+                : TCP(ip_addr, port, side, Options{.backlog = backlog})
+            {
+            }
+
+            /* Create a new TCP object like above, with options applied before binding or connecting */
+            TCP(const std::string ip_addr, const std::string port, const Side &side, const Options &options)
+                : TCP(Endpoint(ip_addr, port), side, options)
+            {
+            }
+
+            /*  Create a new TCP object on a parsed endpoint. A server on "::" is dual-stack and also accepts IPv4
+                clients, which show up as ::ffff:a.b.c.d. With Endpoint::local the same class runs over a Unix
+                domain socket, which skips the TCP/IP stack for peers on the same host */
+            TCP(const Endpoint &endpoint, const Side &side) : TCP(endpoint, side, Options{})
+            {
+            }
+
+            /* Create a new TCP object on a parsed endpoint, with options applied before binding or connecting */
+            TCP(const Endpoint &endpoint, const Side &side, const Options &options) : side(side)
             {
-                sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+                /* The listener is always non-blocking underneath so the backlog can be drained in one go */
+                bool local = endpoint.family() == AF_UNIX;
+                assert_throw(!options.seqpacket || local, "SOCK_SEQPACKET needs a Unix endpoint");
+                int type = options.seqpacket ? SOCK_SEQPACKET : SOCK_STREAM;
+                if (side == Side::SERVER)
+                {
+                    type |= SOCK_NONBLOCK | SOCK_CLOEXEC;
+                }
+                sock_fd = socket(endpoint.family(), type, 0);
                 assert_throw(this->sock_fd != -1, "Failed to create socket");
+                stats.set_fd(sock_fd);
 
-                sock_conf.sin_family = AF_INET;
-                sock_conf.sin_port = htons(std::stoul(port));
-                sock_conf_len = sizeof(sock_conf);
+                std::memcpy(&sock_conf, endpoint.data(), endpoint.size());
+                sock_conf_len = endpoint.size();
 
                 if (side == Side::SERVER)
                 {
-                    sock_conf.sin_addr.s_addr = inet_addr("0.0.0.0");
+                    int value = 1;
+                    if (options.reuse_addr)
+                    {
+                        int ret = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+                        assert_throw(ret != -1, "Failed to set SO_REUSEADDR");
+                    }
+                    if (options.reuse_port)
+                    {
+                        int ret = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value));
+                        assert_throw(ret != -1, "Failed to set SO_REUSEPORT");
+                    }
+                    if (endpoint.is_v6_any())
+                    {
+                        int value = 0;
+                        int ret = setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &value, sizeof(value));
+                        assert_throw(ret != -1, "Failed to set IPV6_V6ONLY");
+                    }
+                    if (options.fast_open != 0 && !local)
+                    {
+                        int ret = setsockopt(sock_fd, IPPROTO_TCP, TCP_FASTOPEN, &options.fast_open,
+                                             sizeof(options.fast_open));
+                        assert_throw(ret != -1, "Failed to set TCP_FASTOPEN");
+                    }
+                    if (local)
+                    {
+                        endpoint.unlink_socket();
+                    }
+
                     int ret = bind(sock_fd, (struct sockaddr *)&sock_conf, sock_conf_len);
                     assert_throw(ret != -1, "Failed to bind to port");
+                    ret = ::listen(sock_fd, options.backlog);
+                    assert_throw(ret != -1, "Failed to start listener");
+                    backlog_size = options.backlog;
                 }
                 else if (side == Side::CLIENT)
                 {
-                    sock_conf.sin_addr.s_addr = inet_addr(ip_addr.c_str());
+                    /* connect returns straight away and the handshake waits for the first write */
+                    if (options.fast_open != 0 && !local)
+                    {
+                        int value = 1;
+                        int ret = setsockopt(sock_fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &value, sizeof(value));
+                        assert_throw(ret != -1, "Failed to set TCP_FASTOPEN_CONNECT");
+                    }
                     int ret = connect(sock_fd, (struct sockaddr *)&sock_conf, sock_conf_len);
                     assert_throw(ret != -1, "Failed to connect to server");
                     sock_conf_len = -1;
                 }
             }
 
-            /* Closes the socket */
+            /* Closes the socket, sending anything still buffered first */
             ~TCP()
             {
-                close(sock_fd);
+                flush_before_close();
+                close_socket();
             }
 
             /* TCP should not be copied, since this is undefined behavior */
@@ -93,19 +678,38 @@ namespace jj
             auto operator=(const TCP &obj) -> TCP & = delete;
 
             /* TCP move constructor */
-            TCP(TCP &&obj)
+            TCP(TCP &&obj) : stats(std::move(obj.stats))
             {
                 sock_fd = obj.sock_fd;
                 sock_conf = obj.sock_conf;
                 sock_conf_len = obj.sock_conf_len;
                 side = obj.side;
+                nonblocking = obj.nonblocking;
+                backlog_size = obj.backlog_size;
+                framing = obj.framing;
+                max_frame = obj.max_frame;
+                rx_buf = std::move(obj.rx_buf);
+                rx_begin = obj.rx_begin;
+                rx_end = obj.rx_end;
+                tx_buf = std::move(obj.tx_buf);
+                tx_used = obj.tx_used;
+                tx_delay = obj.tx_delay;
+                tx_since = obj.tx_since;
+                obj.tx_used = 0;
+                io_timeout = obj.io_timeout;
+                zc_threshold = obj.zc_threshold;
+                zc_next = obj.zc_next;
+                zc_done = obj.zc_done;
+                zc_copied = obj.zc_copied;
+                zc_early = std::move(obj.zc_early);
 
                 obj.sock_fd = -1;
-                std::fill((std::byte *)&sock_conf, (std::byte *)&sock_conf + sizeof(sock_conf), std::byte{0});
+                std::fill((std::byte *)&obj.sock_conf, (std::byte *)&obj.sock_conf + sizeof(obj.sock_conf),
+                          std::byte{0});
                 obj.sock_conf_len = -1;
             }
 
-            /* TCP move assignment */
+            /* TCP move assignment, the socket being replaced sends anything still buffered before it closes */
             auto operator=(TCP &&obj) -> TCP &
             {
                 if (this == &obj)
@@ -113,81 +717,977 @@ namespace jj
                     return *this;
                 }
 
+                flush_before_close();
+                close_socket();
+
                 sock_fd = obj.sock_fd;
                 sock_conf = obj.sock_conf;
                 sock_conf_len = obj.sock_conf_len;
+                side = obj.side;
+                nonblocking = obj.nonblocking;
+                backlog_size = obj.backlog_size;
+                framing = obj.framing;
+                max_frame = obj.max_frame;
+                rx_buf = std::move(obj.rx_buf);
+                rx_begin = obj.rx_begin;
+                rx_end = obj.rx_end;
+                tx_buf = std::move(obj.tx_buf);
+                tx_used = obj.tx_used;
+                tx_delay = obj.tx_delay;
+                tx_since = obj.tx_since;
+                obj.tx_used = 0;
+                io_timeout = obj.io_timeout;
+                zc_threshold = obj.zc_threshold;
+                zc_next = obj.zc_next;
+                zc_done = obj.zc_done;
+                zc_copied = obj.zc_copied;
+                zc_early = std::move(obj.zc_early);
+                stats = std::move(obj.stats);
 
                 obj.sock_fd = -1;
-                std::fill((std::byte *)&sock_conf, (std::byte *)&sock_conf + sizeof(sock_conf), std::byte{0});
+                std::fill((std::byte *)&obj.sock_conf, (std::byte *)&obj.sock_conf + sizeof(obj.sock_conf),
+                          std::byte{0});
                 obj.sock_conf_len = -1;
 
                 return *this;
             }
 
-            /*  Prepare to accept connections on the server, queue_size connections will be queued before
+            /* The underlying socket file descriptor, for use with poll/epoll style APIs */
+            auto fd() const -> int
+            {
+                return sock_fd;
+            }
+
+            /* Which end of the connection this socket is */
+            auto get_side() const -> Side
+            {
+                return side;
+            }
+
+            /*  Switches the socket between blocking and non-blocking mode. In non-blocking mode read and write
+                return -1 instead of throwing when the call would block, and accept_connection throws instead
+                of waiting when the backlog is empty */
+            auto set_nonblocking(bool enable) -> void
+            {
+                if (side == Side::SERVER)
+                {
+                    nonblocking = enable;
+                    return;
+                }
+
+                int flags = fcntl(sock_fd, F_GETFL, 0);
+                assert_throw(flags != -1, "Failed to get socket flags");
+                flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+                int ret = fcntl(sock_fd, F_SETFL, flags);
+                assert_throw(ret != -1, "Failed to set socket flags");
+                nonblocking = enable;
+            }
+
+            /* Whether the socket is in non-blocking mode */
+            auto is_nonblocking() const -> bool
+            {
+                return nonblocking;
+            }
+
+            /*  Gives every read and write that would wait and has no deadline of its own a deadline of timeout
+                from when it starts, they throw TimeoutError once it passes. That covers operator<<, operator>>,
+                send_all, recv_exact, frames, flushes, send_file, recv_file, and read and write on blocking
+                sockets. Zero, the default, waits forever. Checked with poll only when the socket is not ready, so
+                it is free while data flows */
+            auto set_timeout(const std::chrono::steady_clock::duration timeout) -> void
+            {
+                io_timeout = timeout;
+            }
+
+            /* The timeout set with set_timeout, zero if there is none */
+            auto get_timeout() const -> std::chrono::steady_clock::duration
+            {
+                return io_timeout;
+            }
+
+            /*  Changes the listen backlog of the server, queue_size connections will be queued before
                 connections are dropped */
+            auto listen(const std::size_t &queue_size) -> void
+            {
+                assert_throw(side == Side::SERVER, "Must listen on server");
+                int ret = ::listen(sock_fd, queue_size);
+                assert_throw(ret != -1, "Failed to start listener");
+                backlog_size = queue_size;
+            }
+
+            /*  Accepts a single connection from the server, waiting for one to arrive unless the server is in
+                non-blocking mode. The returned connection is blocking */
+            auto accept_connection() -> TCP
+            {
+                assert_throw(side == Side::SERVER, "Must accept connection from server");
+
+                struct sockaddr_storage peer;
+                int new_sock;
+                while ((new_sock = accept_one(peer, SOCK_CLOEXEC)) == -1)
+                {
+                    assert_throw(!nonblocking, "No pending connection to accept");
+                    struct pollfd pfd = {sock_fd, POLLIN, 0};
+                    int ret = poll(&pfd, 1, -1);
+                    assert_throw(ret != -1 || errno == EINTR, "Failed to wait for connection");
+                }
+
+                return TCP(new_sock, peer, false);
+            }
+
+            /*  Kept for compatibility, the backlog is now set once when the server is constructed so queue_size
+                is only applied if it differs from the last one */
             auto accept_connection(const std::size_t &queue_size) -> TCP
+            {
+                if (queue_size != backlog_size)
+                {
+                    listen(queue_size);
+                }
+                return accept_connection();
+            }
+
+            /*  Drains the backlog without blocking, appending up to max non-blocking connections to conns.
+                Returns the number of connections accepted */
+            auto accept_all(std::vector<TCP> &conns, const std::size_t max = SIZE_MAX) -> std::size_t
             {
                 assert_throw(side == Side::SERVER, "Must accept connection from server");
-                int ret = listen(sock_fd, queue_size);
-                assert_throw(ret != -1, "Failed to start listener");
 
-                int new_sock = accept(sock_fd, (struct sockaddr *)&sock_conf, &sock_conf_len);
-                assert_throw(new_sock != -1, "Failed to accept connection");
+                std::size_t accepted = 0;
+                struct sockaddr_storage peer;
+                while (accepted < max)
+                {
+                    int new_sock = accept_one(peer, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (new_sock == -1)
+                    {
+                        break;
+                    }
+                    conns.push_back(TCP(new_sock, peer, true));
+                    ++accepted;
+                }
+                return accepted;
+            }
 
-                return TCP(new_sock);
+            /* The other end of a client or accepted connection */
+            auto peer() const -> Endpoint
+            {
+                assert_throw(side != Side::SERVER, "Server socket has no peer");
+                if (sock_conf.ss_family == AF_UNIX)
+                {
+                    struct sockaddr_storage addr = {};
+                    socklen_t addr_len = sizeof(addr);
+                    int ret = getpeername(sock_fd, (struct sockaddr *)&addr, &addr_len);
+                    assert_throw(ret != -1, "Failed to get peer address");
+                    return Endpoint((const struct sockaddr *)&addr, addr_len);
+                }
+                socklen_t len =
+                    sock_conf.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+                return Endpoint((const struct sockaddr *)&sock_conf, len);
             }
 
-            /* Takes a vector obj and sends it through the socket */
-            template <typename T> friend auto operator<<(TCP &tcp, const std::vector<T> &obj) -> TCP &
+            /* The address of the other end of a client or accepted connection */
+            auto peer_address() const -> std::string
             {
-                assert_throw(tcp.side != jj::TCP::Side::SERVER, "Can not write to server socket");
-                int nbytes = send(tcp.sock_fd, obj.data(), obj.size() * sizeof(T), 0);
-                assert_throw(nbytes != -1, "Failed to write to socket");
+                return peer().address();
+            }
+
+            /* The port of the other end of a client or accepted connection */
+            auto peer_port() const -> std::uint16_t
+            {
+                return peer().port();
+            }
+
+            /*  Sets a typed socket option, e.g. set_option<sockopt::NoDelay>(true). Options set on a server are
+                inherited by the connections it accepts */
+            template <typename O> auto set_option(const typename O::value_type value) -> void
+            {
+                static_assert(O::tcp, "Option does not apply to TCP sockets");
+                int ret = sockopt::set<O>(sock_fd, value);
+                assert_throw(ret != -1, "Failed to set socket option");
+            }
+
+            /* Reads a typed socket option, e.g. get_option<sockopt::SendBuffer>() */
+            template <typename O> auto get_option() const -> typename O::value_type
+            {
+                static_assert(O::tcp, "Option does not apply to TCP sockets");
+                return sockopt::get<O>(sock_fd);
+            }
+
+            /*  Snapshot of the kernel's view of the connection: RTT, congestion window, retransmits and delivery
+                rate. One getsockopt, cheap enough to sample every connection of a server periodically */
+            auto info() const -> Info
+            {
+                assert_throw(side != Side::SERVER, "Server socket has no connection info");
+                assert_throw(sock_conf.ss_family != AF_UNIX, "Unix sockets have no TCP info");
+                RawInfo raw = {};
+                socklen_t len = sizeof(raw);
+                int ret = getsockopt(sock_fd, IPPROTO_TCP, TCP_INFO, &raw, &len);
+                assert_throw(ret != -1, "Failed to get TCP_INFO");
+
+                return Info{raw.base.tcpi_state,
+                            raw.base.tcpi_ca_state,
+                            std::chrono::microseconds(raw.base.tcpi_rtt),
+                            std::chrono::microseconds(raw.base.tcpi_rttvar),
+                            std::chrono::microseconds(raw.min_rtt),
+                            std::chrono::microseconds(raw.base.tcpi_rto),
+                            raw.base.tcpi_snd_cwnd,
+                            raw.base.tcpi_snd_ssthresh,
+                            raw.base.tcpi_snd_mss,
+                            raw.base.tcpi_retransmits,
+                            raw.base.tcpi_total_retrans,
+                            raw.base.tcpi_unacked,
+                            raw.base.tcpi_lost,
+                            raw.delivery_rate,
+                            raw.pacing_rate,
+                            raw.bytes_acked,
+                            raw.bytes_received,
+                            raw.bytes_sent,
+                            raw.bytes_retrans,
+                            raw.notsent_bytes};
+            }
+
+            /*  Sets the options of a named profile in one call, options the process lacks the privileges for are
+                skipped */
+            auto set_profile(const sockopt::Profile profile) -> void
+            {
+                sockopt::apply(sock_fd, profile, sock_conf.ss_family, true);
+            }
+
+            /*  On a server, prefers this listener for connections whose packets were handled on cpu when several
+                SO_REUSEPORT listeners share a port. On a connection, incoming_cpu reports that cpu */
+            auto set_incoming_cpu(const int cpu) -> void
+            {
+                int ret = setsockopt(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+                assert_throw(ret != -1, "Failed to set SO_INCOMING_CPU");
+            }
+
+            /* The cpu that last handled packets for this socket, -1 if none have arrived yet */
+            auto incoming_cpu() const -> int
+            {
+                int cpu = -1;
+                socklen_t len = sizeof(cpu);
+                int ret = getsockopt(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len);
+                assert_throw(ret != -1, "Failed to get SO_INCOMING_CPU");
+                return cpu;
+            }
+
+            /*  Attaches a classic BPF program that picks which SO_REUSEPORT listener gets each new connection.
+                It applies to every listener bound to the port and returns an index in the order the listeners
+                were bound, out of range indexes fall back to the kernel's hash */
+            auto attach_reuseport_filter(const std::vector<struct sock_filter> &program) -> void
+            {
+                assert_throw(side == Side::SERVER, "Reuseport filters can only be attached to a server");
+                struct sock_fprog prog = {static_cast<unsigned short>(program.size()),
+                                          const_cast<struct sock_filter *>(program.data())};
+                int ret = setsockopt(sock_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+                assert_throw(ret != -1, "Failed to attach reuseport filter");
+            }
+
+            /*  Sends all size bytes of msg, carrying on after short writes and EINTR. Non-blocking sockets wait
+                for room in the send buffer instead of failing */
+            auto send_all(const void *msg, const std::size_t size) -> void
+            {
+                send_all(msg, size, default_deadline());
+            }
+
+            /*  Same as above, but throws TimeoutError if the peer has not taken everything by deadline. Part of
+                msg may have been sent by then, so the stream can not be picked up where it stopped */
+            auto send_all(const void *msg, const std::size_t size, const std::chrono::steady_clock::time_point deadline)
+                -> void
+            {
+                struct iovec iov = {const_cast<void *>(msg), size};
+                send_all_iov(&iov, 1, deadline);
+            }
+
+            /*  Turns on buffered writes, everything written collects in a buffer of capacity bytes and only goes
+                out on flush(), when the buffer fills up or, when max_delay is non zero, on the first write after
+                the oldest buffered byte is max_delay old. Reads flush first. A capacity of 0 turns buffering
+                off again after flushing */
+            auto set_buffered(const std::size_t capacity, const std::chrono::steady_clock::duration max_delay = {})
+                -> void
+            {
+                flush_pending();
+                tx_buf.assign(capacity, 0);
+                tx_buf.shrink_to_fit();
+                tx_delay = max_delay;
+            }
+
+            /* Number of bytes waiting in the write buffer */
+            auto buffered() const -> std::size_t
+            {
+                return tx_used;
+            }
+
+            /* Sends everything in the write buffer */
+            auto flush() -> void
+            {
+                if (tx_used == 0)
+                {
+                    return;
+                }
+                struct iovec iov = {tx_buf.data(), tx_used};
+                tx_used = 0;
+                transmit(&iov, 1, 0, default_deadline());
+            }
+
+            /*  Flushes if the oldest buffered byte has waited longer than the delay given to set_buffered. Event
+                loops should call this when they wake up so a quiet connection still meets its deadline */
+            auto flush_if_due() -> void
+            {
+                if (tx_used != 0 && std::chrono::steady_clock::now() - tx_since >= tx_delay)
+                {
+                    flush();
+                }
+            }
+
+            /*  Sets TCP_CORK, while corked the kernel only sends full segments. Uncorking sends whatever is
+                left, which makes cork/uncork a way to assemble one message out of several flushes */
+            auto set_cork(const bool enable) -> void
+            {
+                int value = enable;
+                int ret = setsockopt(sock_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+                assert_throw(ret != -1, "Failed to set TCP_CORK");
+            }
+
+            /*  Turns on MSG_ZEROCOPY for objects of at least threshold bytes passed to operator<<, smaller ones
+                keep using the copy path. A threshold of 0 turns it off. While a zerocopy send is in flight the
+                kernel reads straight from the caller's memory, so the buffer must not be changed or freed until
+                zerocopy_done reports its ticket as complete */
+            auto set_zerocopy(const std::size_t threshold = 16 << 10) -> void
+            {
+                if (threshold != 0)
+                {
+                    int value = 1;
+                    int ret = setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &value, sizeof(value));
+                    assert_throw(ret != -1, "Failed to set SO_ZEROCOPY");
+                }
+                zc_threshold = threshold;
+            }
+
+            /*  Sends all size bytes of msg without copying them into the kernel. Returns a ticket that
+                zerocopy_done accepts, msg has to stay untouched until then. Falls back to a copy if the kernel
+                runs out of memory for pinning pages */
+            auto send_zerocopy(const void *msg, const std::size_t size) -> std::uint32_t
+            {
+                assert_throw(side != Side::SERVER, "Can not write to server socket");
+                flush_pending();
+                auto deadline = default_deadline();
+                const char *pos = static_cast<const char *>(msg);
+                std::size_t left = size;
+                int flags = MSG_NOSIGNAL | MSG_ZEROCOPY;
+                while (left != 0)
+                {
+                    auto call = [&](int extra) { return send(sock_fd, pos, left, flags | extra); };
+                    ssize_t nbytes = io_until(true, left, deadline, call);
+                    if (nbytes == -1)
+                    {
+                        if (errno == ENOBUFS)
+                        {
+                            struct iovec iov = {const_cast<char *>(pos), left};
+                            transmit(&iov, 1, 0, deadline);
+                            break;
+                        }
+                        throw_io_error(true);
+                    }
+                    ++zc_next;
+                    pos += nbytes;
+                    left -= nbytes;
+                }
+                return zc_next;
+            }
+
+            /* Ticket covering every zerocopy send so far, including the ones made by operator<< */
+            auto zerocopy_ticket() const -> std::uint32_t
+            {
+                return zc_next;
+            }
+
+            /*  Reads zerocopy completions from the socket error queue without blocking. Returns the number of
+                notifications handled */
+            auto reap_zerocopy() -> std::size_t
+            {
+                std::size_t handled = 0;
+                while (zc_done != zc_next)
+                {
+                    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+                    struct msghdr msg = {};
+                    msg.msg_control = control;
+                    msg.msg_controllen = sizeof(control);
+                    int ret = recvmsg(sock_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+                    if (ret == -1)
+                    {
+                        if (errno == EINTR)
+                        {
+                            continue;
+                        }
+                        assert_throw(errno == EAGAIN || errno == EWOULDBLOCK, "Failed to read error queue");
+                        break;
+                    }
+
+                    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+                    {
+                        bool v4 = cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR;
+                        bool v6 = cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR;
+                        if (!v4 && !v6)
+                        {
+                            continue;
+                        }
+                        struct sock_extended_err err;
+                        std::memcpy(&err, CMSG_DATA(cm), sizeof(err));
+                        if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                        {
+                            continue;
+                        }
+                        /* The kernel had to copy after all, e.g. on loopback, the send still completed */
+                        if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                        {
+                            zc_copied += err.ee_data - err.ee_info + 1;
+                        }
+                        complete_zerocopy(err.ee_info, err.ee_data);
+                        ++handled;
+                    }
+                }
+                return handled;
+            }
+
+            /* Whether the buffers of every zerocopy send up to ticket can be reused or freed */
+            auto zerocopy_done(const std::uint32_t ticket) -> bool
+            {
+                if (static_cast<std::int32_t>(ticket - zc_done) > 0)
+                {
+                    reap_zerocopy();
+                }
+                return static_cast<std::int32_t>(ticket - zc_done) <= 0;
+            }
+
+            /* Waits until the buffers of every zerocopy send up to ticket can be reused or freed */
+            auto wait_zerocopy(const std::uint32_t ticket) -> void
+            {
+                while (!zerocopy_done(ticket))
+                {
+                    wait_ready(POLLERR);
+                }
+            }
+
+            /* Number of zerocopy sends the kernel ended up copying anyway */
+            auto zerocopy_copied() const -> std::size_t
+            {
+                return zc_copied;
+            }
+
+            /*  Streams length bytes of the file fd starting at offset straight from the page cache to the socket
+                with sendfile, nothing passes through userspace. Stops early at the end of the file, returns the
+                number of bytes sent */
+            auto send_file(const int fd, const off_t offset, const std::size_t length) -> std::size_t
+            {
+                return send_file(fd, offset, length, default_deadline());
+            }
+
+            /*  Same as above, but throws TimeoutError if the file has not been sent by deadline. What was sent
+                before that is gone. sendfile has no MSG_DONTWAIT, so a blocking socket is non-blocking for the
+                duration of the call */
+            auto send_file(const int fd, off_t offset, const std::size_t length,
+                           const std::chrono::steady_clock::time_point deadline) -> std::size_t
+            {
+                assert_throw(side != Side::SERVER, "Can not write to server socket");
+                flush_pending();
+                bool toggle = deadline != NO_DEADLINE && !nonblocking;
+                if (toggle)
+                {
+                    set_nonblocking(true);
+                }
+
+                std::size_t left = length;
+                try
+                {
+                    while (left != 0)
+                    {
+                        std::size_t chunk = std::min<std::size_t>(left, 1 << 30);
+                        ssize_t nbytes = stats.send(chunk, [&] { return sendfile(sock_fd, fd, &offset, chunk); });
+                        if (nbytes == -1)
+                        {
+                            if (errno == EINTR)
+                            {
+                                continue;
+                            }
+                            assert_throw(errno == EAGAIN || errno == EWOULDBLOCK, "Failed to send file");
+                            wait_ready(POLLOUT, deadline);
+                            continue;
+                        }
+                        if (nbytes == 0)
+                        {
+                            break;
+                        }
+                        left -= nbytes;
+                    }
+                }
+                catch (...)
+                {
+                    if (toggle)
+                    {
+                        set_nonblocking(false);
+                    }
+                    throw;
+                }
+                if (toggle)
+                {
+                    set_nonblocking(false);
+                }
+                return length - left;
+            }
+
+            /*  Streams the file at path from offset to its end, or length bytes if given, returns the number of
+                bytes sent */
+            auto send_file(const std::string &path, const off_t offset = 0, const std::size_t length = SIZE_MAX)
+                -> std::size_t
+            {
+                int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                assert_throw(fd != -1, "Failed to open file");
+                struct stat st;
+                std::size_t sent = 0;
+                try
+                {
+                    assert_throw(fstat(fd, &st) != -1, "Failed to stat file");
+                    std::size_t size = st.st_size > offset ? st.st_size - offset : 0;
+                    sent = send_file(fd, offset, std::min(length, size));
+                }
+                catch (...)
+                {
+                    close(fd);
+                    throw;
+                }
+                close(fd);
+                return sent;
+            }
+
+            /*  Moves exactly length bytes from the socket into the file fd at offset (or its current position if
+                offset is -1) by splicing through a pipe, so the data never passes through userspace. Throws if
+                the peer closes the connection first */
+            auto recv_file(const int fd, const off_t offset, const std::size_t length) -> void
+            {
+                recv_file(fd, offset, length, default_deadline());
+            }
+
+            /*  Same as above, but throws TimeoutError if the bytes have not all arrived by deadline. The ones
+                that did are in the file. splice ignores SPLICE_F_NONBLOCK on the socket side, so a blocking
+                socket is non-blocking for the duration of the call */
+            auto recv_file(const int fd, const off_t offset, const std::size_t length,
+                           const std::chrono::steady_clock::time_point deadline) -> void
+            {
+                assert_throw(side != Side::SERVER, "Can not read from server socket");
+                flush_pending();
+                loff_t file_off = offset;
+                loff_t *off_ptr = offset == -1 ? nullptr : &file_off;
+                std::size_t left = length;
+
+                /* Bytes the framed mode already pulled off the socket have to go first */
+                std::size_t early = std::min(left, rx_end - rx_begin);
+                if (early != 0)
+                {
+                    ssize_t nbytes = offset == -1 ? ::write(fd, rx_buf.data() + rx_begin, early)
+                                                  : pwrite(fd, rx_buf.data() + rx_begin, early, file_off);
+                    assert_throw(nbytes == static_cast<ssize_t>(early), "Failed to write file");
+                    rx_begin += early;
+                    file_off += early;
+                    left -= early;
+                }
+
+                int pipe_fds[2];
+                assert_throw(pipe2(pipe_fds, O_CLOEXEC) != -1, "Failed to create pipe");
+                /* A bigger pipe means fewer splice round trips, it is fine if the system limit refuses */
+                fcntl(pipe_fds[1], F_SETPIPE_SZ, 1 << 20);
+
+                bool toggle = deadline != NO_DEADLINE && !nonblocking;
+                try
+                {
+                    if (toggle)
+                    {
+                        set_nonblocking(true);
+                    }
+                    while (left != 0)
+                    {
+                        ssize_t in = stats.recv(left,
+                                                [&]
+                                                {
+                                                    return splice(sock_fd, nullptr, pipe_fds[1], nullptr, left,
+                                                                  SPLICE_F_MOVE | SPLICE_F_MORE);
+                                                });
+                        if (in == -1)
+                        {
+                            if (errno == EINTR)
+                            {
+                                continue;
+                            }
+                            assert_throw(errno == EAGAIN || errno == EWOULDBLOCK, "Failed to read from socket");
+                            wait_ready(POLLIN, deadline);
+                            continue;
+                        }
+                        assert_throw(in != 0, "Connection closed by peer");
+                        left -= in;
+
+                        while (in != 0)
+                        {
+                            ssize_t out = splice(pipe_fds[0], nullptr, fd, off_ptr, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+                            if (out == -1 && errno == EINTR)
+                            {
+                                continue;
+                            }
+                            assert_throw(out > 0, "Failed to write file");
+                            in -= out;
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    close(pipe_fds[0]);
+                    close(pipe_fds[1]);
+                    if (toggle)
+                    {
+                        set_nonblocking(false);
+                    }
+                    throw;
+                }
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                if (toggle)
+                {
+                    set_nonblocking(false);
+                }
+            }
+
+            /* Receives exactly length bytes from the socket into a new file at path, replacing it if it exists */
+            auto recv_file(const std::string &path, const std::size_t length) -> void
+            {
+                int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                assert_throw(fd != -1, "Failed to open file");
+                try
+                {
+                    recv_file(fd, 0, length);
+                }
+                catch (...)
+                {
+                    close(fd);
+                    throw;
+                }
+                close(fd);
+            }
+
+            /*  Receives exactly size bytes into msg, carrying on after short reads and EINTR. Throws if the peer
+                closes the connection first */
+            auto recv_exact(void *msg, const std::size_t size) -> void
+            {
+                recv_exact(msg, size, default_deadline());
+            }
+
+            /*  Same as above, but throws TimeoutError if the bytes have not all arrived by deadline. The ones
+                that did are in msg, but the stream can not be picked up where it stopped */
+            auto recv_exact(void *msg, const std::size_t size, const std::chrono::steady_clock::time_point deadline)
+                -> void
+            {
+                assert_throw(side != Side::SERVER, "Can not read from server socket");
+                flush_pending();
+                char *pos = static_cast<char *>(msg);
+                std::size_t left = size;
+                /*  Let the kernel do the looping on blocking sockets, most calls then finish in one syscall. With a
+                    deadline the waiting has to happen in poll instead */
+                int flags = nonblocking || deadline != NO_DEADLINE ? 0 : MSG_WAITALL;
+                while (left != 0)
+                {
+                    ssize_t nbytes = io_until(false, left, deadline,
+                                              [&](int extra) { return recv(sock_fd, pos, left, flags | extra); });
+                    if (nbytes == -1)
+                    {
+                        throw_io_error(false);
+                    }
+                    assert_throw(nbytes != 0, "Connection closed by peer");
+                    pos += nbytes;
+                    left -= nbytes;
+                }
+            }
+
+            /*  Switches between RAW and LENGTH_PREFIXED messages, both ends must agree. In framed mode every
+                operator<< sends one frame and every operator>> returns one frame, frames over max_frame bytes
+                are rejected. Incoming data is read in large chunks so many small frames cost one recv */
+            auto set_framing(const Framing mode, const std::size_t max_frame_size = 64 << 20) -> void
+            {
+                framing = mode;
+                max_frame = max_frame_size;
+                if (mode == Framing::LENGTH_PREFIXED && rx_buf.empty())
+                {
+                    rx_buf.resize(64 << 10);
+                }
+            }
+
+            /* The current framing mode */
+            auto get_framing() const -> Framing
+            {
+                return framing;
+            }
+
+            /* Sends size bytes of msg as a single frame, the header and payload go out in one sendmsg */
+            auto write_frame(const void *msg, const std::size_t size) -> void
+            {
+                unsigned char header[10];
+                struct iovec iov[2] = {{header, encode_length(size, header)}, {const_cast<void *>(msg), size}};
+                send_all_iov(iov, 2, default_deadline());
+            }
+
+            /* Waits for the next frame, the view is only valid until the next read from this socket */
+            auto read_frame() -> std::string_view
+            {
+                return read_frame(default_deadline());
+            }
+
+            /*  Waits for the next frame until deadline, then throws TimeoutError. A frame that was only partly
+                there stays buffered and the next read carries on with it */
+            auto read_frame(const std::chrono::steady_clock::time_point deadline) -> std::string_view
+            {
+                std::optional<std::string_view> frame = next_frame(deadline);
+                if (!frame)
+                {
+                    throw TimeoutError("Timed out reading from socket");
+                }
+                return *frame;
+            }
+
+            /*  Returns the next frame if one can be assembled without blocking, for use from Reactor handlers.
+                The view is only valid until the next read from this socket */
+            auto poll_frame() -> std::optional<std::string_view>
+            {
+                return next_frame(std::chrono::steady_clock::time_point::min());
+            }
+
+            /* Sends every element of obj */
+            template <typename T> auto send_all(const std::vector<T> &obj) -> void
+            {
+                static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be sent");
+                send_all(obj.data(), obj.size() * sizeof(T));
+            }
+
+            /* Fills every element of obj, the vector must already be sized to the number of elements expected */
+            template <typename T> auto recv_exact(std::vector<T> &obj) -> void
+            {
+                static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be received");
+                recv_exact(obj.data(), obj.size() * sizeof(T));
+            }
+
+            /*  Collects the objects of a chained operator<< and sends them with one sendmsg, so
+                `tcp.batch() << header << payload << trailer;` costs a single syscall. Small objects are copied
+                into the batch, larger ones are referenced in place, so a Batch must not outlive the large objects
+                put in it */
+            class Batch
+            {
+                public:
+                    /* Number of separate buffers gathered before the batch is sent early */
+                    static constexpr int MAX_IOV = 64;
+
+                    /* Objects up to this size are copied instead of referenced */
+                    static constexpr std::size_t COPY_LIMIT = 64;
+
+                    /* Bytes of copied objects held before the batch is sent early */
+                    static constexpr std::size_t INLINE_BYTES = 1024;
+
+                private:
+                    TCP &tcp;
+                    int uncaught;
+                    int count = 0;
+                    bool last_inline = false;
+                    std::size_t used = 0;
+                    struct iovec iov[MAX_IOV];
+                    char storage[INLINE_BYTES];
+
+                    /* Copies size bytes into the batch, merging with the previous copy where possible */
+                    auto copy_in(const void *data, const std::size_t size) -> void
+                    {
+                        if (used + size > INLINE_BYTES || (!last_inline && count == MAX_IOV))
+                        {
+                            send();
+                        }
+                        if (last_inline)
+                        {
+                            iov[count - 1].iov_len += size;
+                        }
+                        else
+                        {
+                            iov[count++] = {storage + used, size};
+                        }
+                        std::memcpy(storage + used, data, size);
+                        used += size;
+                        last_inline = true;
+                    }
+
+                    /*  Queues size bytes of data. Large temporaries are sent straight away since they are
+                        destroyed before the batch is */
+                    auto add(const void *data, const std::size_t size, const bool temporary) -> void
+                    {
+                        if (tcp.framing == Framing::LENGTH_PREFIXED)
+                        {
+                            unsigned char header[10];
+                            copy_in(header, encode_length(size, header));
+                        }
+
+                        if (size <= COPY_LIMIT)
+                        {
+                            copy_in(data, size);
+                            return;
+                        }
+
+                        /* Temporaries are gone before the kernel is done with them so they are always copied */
+                        if (!temporary && tcp.zc_threshold != 0 && size >= tcp.zc_threshold)
+                        {
+                            send();
+                            tcp.send_zerocopy(data, size);
+                            return;
+                        }
+
+                        if (count == MAX_IOV)
+                        {
+                            send();
+                        }
+                        iov[count++] = {const_cast<void *>(data), size};
+                        last_inline = false;
+                        if (temporary)
+                        {
+                            send();
+                        }
+                    }
+
+                    template <typename T> auto put(const std::vector<T> &obj, const bool temporary) -> void
+                    {
+                        static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be sent");
+                        add(obj.data(), obj.size() * sizeof(T), temporary);
+                    }
+
+                    auto put(const std::string &obj, const bool temporary) -> void
+                    {
+                        bool framed = tcp.framing == Framing::LENGTH_PREFIXED;
+                        add(obj.c_str(), framed ? obj.size() : obj.size() + 1, temporary);
+                    }
+
+                    template <typename T> auto put(const T &obj, const bool temporary) -> void
+                    {
+                        static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be sent");
+                        add(&obj, sizeof(obj), temporary);
+                    }
+
+                public:
+                    /* Start an empty batch on tcp */
+                    explicit Batch(TCP &tcp) : tcp(tcp), uncaught(std::uncaught_exceptions())
+                    {
+                    }
+
+                    /*  Sends whatever is queued. While an exception unwinds the batch it is dropped instead, so a
+                        failing send can not end in std::terminate */
+                    ~Batch() noexcept(false)
+                    {
+                        if (std::uncaught_exceptions() == uncaught)
+                        {
+                            send();
+                        }
+                    }
+
+                    /* Batch should not be copied, since this is undefined behavior */
+                    Batch(const Batch &obj) = delete;
+
+                    /* Batch should not be copied, since this is undefined behavior */
+                    auto operator=(const Batch &obj) -> Batch & = delete;
+
+                    /* Sends everything queued so far in one go */
+                    auto send() -> void
+                    {
+                        if (count != 0)
+                        {
+                            tcp.send_all_iov(iov, count, tcp.default_deadline());
+                        }
+                        count = 0;
+                        used = 0;
+                        last_inline = false;
+                    }
+
+                    /*  Queues obj, vectors queue all of their elements, strings are queued with their terminator
+                        (left out in framed mode) and anything else trivially copyable is queued as its bytes */
+                    template <typename T> auto operator<<(T &&obj) -> Batch &
+                    {
+                        put(obj, !std::is_lvalue_reference_v<T>);
+                        return *this;
+                    }
+            };
+
+            /*  Starts a batch, everything put into it with operator<< goes out in one sendmsg on send() or when
+                it goes out of scope, e.g. at the end of `tcp.batch() << a << b;` */
+            auto batch() -> Batch
+            {
+                return Batch(*this);
+            }
+
+            /*  Writes obj to the socket. Vectors send all of their elements, strings are sent with their
+                terminator and any other trivially copyable object is sent as its bytes. In framed mode every
+                object becomes one frame. Every object is sent on its own, use batch() to gather several */
+            template <typename T> friend auto operator<<(TCP &tcp, T &&obj) -> TCP &
+            {
+                Batch batch(tcp);
+                batch << std::forward<T>(obj);
+                batch.send();
                 return tcp;
             }
 
             /*  Takes a vector obj and writes to it, uses capacity as the buffer limit and resizes
-                the vector to the number of bytes received from the socket */
+                the vector to the number of elements received from the socket. An element split across
+                reads is completed before returning. In framed mode the vector is resized to the frame */
             template <typename T> friend auto operator>>(TCP &tcp, std::vector<T> &obj) -> TCP &
             {
+                static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be received");
+                if (tcp.framing == Framing::LENGTH_PREFIXED)
+                {
+                    std::string_view frame = tcp.read_frame();
+                    assert_throw(frame.size() % sizeof(T) == 0, "Frame is not a whole number of elements");
+                    obj.resize(frame.size() / sizeof(T));
+                    std::copy(frame.begin(), frame.end(), reinterpret_cast<char *>(obj.data()));
+                    return tcp;
+                }
+
                 assert_throw(tcp.side != jj::TCP::Side::SERVER, "Can not read from server socket");
+                tcp.flush_pending();
                 obj.resize(obj.capacity());
-                int nbytes = recv(tcp.sock_fd, obj.data(), obj.capacity() * sizeof(T), 0);
-                assert_throw(nbytes != -1, "Failed to read from socket");
-                obj.resize(nbytes / sizeof(T));
-                return tcp;
-            }
+                auto deadline = tcp.default_deadline();
+                std::size_t room = obj.capacity() * sizeof(T);
+                ssize_t nbytes = tcp.io_until(false, room, deadline,
+                                              [&](int extra) { return recv(tcp.sock_fd, obj.data(), room, extra); });
+                if (nbytes == -1)
+                {
+                    throw_io_error(false);
+                }
 
-            /*  Takes a string obj and writes it to the socket */
-            friend auto operator<<(TCP &tcp, const std::string &obj) -> TCP &
-            {
-                assert_throw(tcp.side != jj::TCP::Side::SERVER, "Can not write to server socket");
-                int nbytes = send(tcp.sock_fd, obj.c_str(), obj.size() + 1, 0);
-                assert_throw(nbytes != -1, "Failed to write to socket");
+                std::size_t torn = nbytes % sizeof(T);
+                if (torn != 0)
+                {
+                    tcp.recv_exact(reinterpret_cast<char *>(obj.data()) + nbytes, sizeof(T) - torn, deadline);
+                    nbytes += sizeof(T) - torn;
+                }
+                obj.resize(nbytes / sizeof(T));
                 return tcp;
             }
 
             /*  Takes a string obj and writes to it, uses capacity as the buffer limit and resizes
                 the string to the number of bytes received from the socket.
-                Since resize trucates the string, ensure that it is resized upon reuse. */
+                Since resize trucates the string, ensure that it is resized upon reuse.
+                In framed mode the string is replaced by the next frame */
             friend auto operator>>(TCP &tcp, std::string &obj) -> TCP &
             {
+                if (tcp.framing == Framing::LENGTH_PREFIXED)
+                {
+                    obj.assign(tcp.read_frame());
+                    return tcp;
+                }
+
                 assert_throw(tcp.side != jj::TCP::Side::SERVER, "Can not read from server socket");
-                int nbytes = recv(tcp.sock_fd, obj.data(), obj.capacity(), 0);
+                tcp.flush_pending();
+                std::size_t room = obj.capacity();
+                ssize_t nbytes = tcp.io_until(false, room, tcp.default_deadline(),
+                                              [&](int extra) { return recv(tcp.sock_fd, obj.data(), room, extra); });
+                if (nbytes == -1)
+                {
+                    throw_io_error(false);
+                }
                 obj.resize(nbytes);
-                assert_throw(nbytes != -1, "Failed to read from socket");
-                return tcp;
-            }
-
-            /*  A generic write that takes any object writes it though the socket.
-                Ensure that the object is trivial since this only writes using the address
-                and size of the object */
-            template <typename T> friend auto operator<<(TCP &tcp, const T &obj) -> TCP &
-            {
-                assert_throw(tcp.side != jj::TCP::Side::SERVER, "Can not write to server socket");
-                int nbytes = send(tcp.sock_fd, &obj, sizeof(obj), 0);
-                assert_throw(nbytes != -1, "Failed to write to socket");
                 return tcp;
             }
 
@@ -196,29 +1696,229 @@ namespace jj
                 and size of the object */
             template <typename T> friend auto operator>>(TCP &tcp, T &obj) -> TCP &
             {
-                assert_throw(tcp.side != jj::TCP::Side::SERVER, "Can not read from server socket");
-                int nbytes = recv(tcp.sock_fd, &obj, sizeof(obj), 0);
-                assert_throw(nbytes != -1, "Failed to read from socket");
+                static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be received");
+                if (tcp.framing == Framing::LENGTH_PREFIXED)
+                {
+                    std::string_view frame = tcp.read_frame();
+                    assert_throw(frame.size() == sizeof(obj), "Frame does not match the size of the object");
+                    std::copy(frame.begin(), frame.end(), reinterpret_cast<char *>(&obj));
+                    return tcp;
+                }
+                tcp.recv_exact(&obj, sizeof(obj));
                 return tcp;
             }
 
-            /* A direct wrapper around the underlying send function */
+            /*  A direct wrapper around the underlying send function, returns -1 if the socket is non-blocking
+                and the send would block */
             auto write(const void *msg, const std::size_t size) -> ssize_t
             {
                 assert_throw(side != Side::SERVER, "Can not write to server socket");
-                int nbytes = send(sock_fd, msg, size, 0);
+                flush_pending();
+                if (!nonblocking)
+                {
+                    return write(msg, size, default_deadline());
+                }
+                ssize_t nbytes = stats.send(size, [&] { return send(sock_fd, msg, size, MSG_NOSIGNAL); });
+                if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    return -1;
+                }
                 assert_throw(nbytes != -1, "Failed to write to socket");
                 return nbytes;
             }
 
-            /* A direct wrapper around the underlying write function */
+            /*  Sends as much of msg as there is room for, waiting until deadline for some room in either
+                blocking mode. Throws TimeoutError once the deadline passes */
+            auto write(const void *msg, const std::size_t size, const std::chrono::steady_clock::time_point deadline)
+                -> ssize_t
+            {
+                assert_throw(side != Side::SERVER, "Can not write to server socket");
+                flush_pending();
+                ssize_t nbytes = io_until(true, size, deadline,
+                                          [&](int extra) { return send(sock_fd, msg, size, MSG_NOSIGNAL | extra); });
+                if (nbytes == -1)
+                {
+                    throw_io_error(true);
+                }
+                return nbytes;
+            }
+
+            /*  A direct wrapper around the underlying write function, returns -1 if the socket is non-blocking
+                and there is nothing to read */
             auto read(void *msg, std::size_t size) -> ssize_t
             {
                 assert_throw(side != Side::SERVER, "Can not read from server socket");
-                int nbytes = recv(sock_fd, msg, size, 0);
+                flush_pending();
+                if (!nonblocking)
+                {
+                    return read(msg, size, default_deadline());
+                }
+                ssize_t nbytes = stats.recv(size, [&] { return recv(sock_fd, msg, size, 0); });
+                if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    return -1;
+                }
                 assert_throw(nbytes != -1, "Failed to read from socket");
                 return nbytes;
             }
+
+            /*  Reads whatever has arrived, up to size bytes, waiting until deadline for something to arrive in
+                either blocking mode. Returns 0 once the peer closed the connection and throws TimeoutError once
+                the deadline passes, so a stalled peer can not hold the caller forever */
+            auto read(void *msg, const std::size_t size, const std::chrono::steady_clock::time_point deadline)
+                -> ssize_t
+            {
+                assert_throw(side != Side::SERVER, "Can not read from server socket");
+                flush_pending();
+                ssize_t nbytes =
+                    io_until(false, size, deadline, [&](int extra) { return recv(sock_fd, msg, size, extra); });
+                if (nbytes == -1)
+                {
+                    throw_io_error(false);
+                }
+                return nbytes;
+            }
+
+            /* Same as above with a deadline timeout from now */
+            auto read_for(void *msg, const std::size_t size, const std::chrono::steady_clock::duration timeout)
+                -> ssize_t
+            {
+                return read(msg, size, std::chrono::steady_clock::now() + timeout);
+            }
+
+            /*  Reads straight into the free space of ring and commits what arrived, returns -1 if the socket is
+                non-blocking and there is nothing to read. Throws if the ring is full */
+            auto read(MirrorRing &ring) -> ssize_t
+            {
+                std::span<char> space = ring.writable();
+                assert_throw(!space.empty(), "Ring is full");
+                ssize_t nbytes = read(space.data(), space.size());
+                if (nbytes > 0)
+                {
+                    ring.commit(nbytes);
+                }
+                return nbytes;
+            }
+
+            /*  Version of write whose failed syscalls come back as the errno they were raised with, so a
+                non-blocking socket that would block costs nothing beyond the syscall. EINTR is retried. Anything
+                else, e.g. running out of memory, still throws. Buffered writes go out first without waiting, so a
+                full send buffer gives EAGAIN even on a blocking socket */
+            auto try_write(const void *msg, const std::size_t size) -> std::expected<std::size_t, std::error_code>
+            {
+                if (side == Side::SERVER)
+                {
+                    return std::unexpected(std::make_error_code(std::errc::not_connected));
+                }
+                if (std::error_code ec = try_flush_pending())
+                {
+                    return std::unexpected(ec);
+                }
+                ssize_t nbytes;
+                do
+                {
+                    nbytes = stats.send(size, [&] { return send(sock_fd, msg, size, MSG_NOSIGNAL); });
+                } while (nbytes == -1 && errno == EINTR);
+                if (nbytes == -1)
+                {
+                    return std::unexpected(std::error_code(errno, std::system_category()));
+                }
+                return nbytes;
+            }
+
+            /*  Version of read that gives 0 once the peer closed the connection and the errno of a failed syscall,
+                e.g. std::errc::resource_unavailable_try_again when a non-blocking socket is empty. Like try_write
+                it still throws for anything but the syscalls, and buffered writes go out first without waiting */
+            auto try_read(void *msg, const std::size_t size) -> std::expected<std::size_t, std::error_code>
+            {
+                if (side == Side::SERVER)
+                {
+                    return std::unexpected(std::make_error_code(std::errc::not_connected));
+                }
+                if (std::error_code ec = try_flush_pending())
+                {
+                    return std::unexpected(ec);
+                }
+                ssize_t nbytes;
+                do
+                {
+                    nbytes = stats.recv(size, [&] { return recv(sock_fd, msg, size, 0); });
+                } while (nbytes == -1 && errno == EINTR);
+                if (nbytes == -1)
+                {
+                    return std::unexpected(std::error_code(errno, std::system_category()));
+                }
+                return nbytes;
+            }
+
+            /*  try_read with a deadline, gives std::errc::timed_out once it passes without anything arriving */
+            auto try_read(void *msg, const std::size_t size, const std::chrono::steady_clock::time_point deadline)
+                -> std::expected<std::size_t, std::error_code>
+            {
+                if (side == Side::SERVER)
+                {
+                    return std::unexpected(std::make_error_code(std::errc::not_connected));
+                }
+                if (std::error_code ec = try_flush_pending())
+                {
+                    return std::unexpected(ec);
+                }
+                ssize_t nbytes =
+                    io_until(false, size, deadline, [&](int extra) { return recv(sock_fd, msg, size, extra); });
+                if (nbytes == -1)
+                {
+                    return std::unexpected(std::error_code(errno, std::system_category()));
+                }
+                return nbytes;
+            }
+
+            /*  Accept of a single pending connection whose failure comes back as the errno of accept4, never waits
+                since the listener itself is non-blocking. The connection inherits the server's blocking mode.
+                Connections that died in the backlog are skipped. Setting up the connection can still throw */
+            auto try_accept() -> std::expected<TCP, std::error_code>
+            {
+                if (side != Side::SERVER)
+                {
+                    return std::unexpected(std::make_error_code(std::errc::invalid_argument));
+                }
+                struct sockaddr_storage peer;
+                while (true)
+                {
+                    socklen_t peer_len = sizeof(peer);
+                    int new_sock = accept4(sock_fd, (struct sockaddr *)&peer, &peer_len,
+                                           SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+                    if (new_sock != -1)
+                    {
+                        return TCP(new_sock, peer, nonblocking);
+                    }
+                    if (errno != EINTR && errno != ECONNABORTED && errno != EPROTO)
+                    {
+                        return std::unexpected(std::error_code(errno, std::system_category()));
+                    }
+                }
+            }
+
+            /*  Awaitable operations for coroutines running on an EventLoop, they are defined in async.hh. Each
+                one tries the syscall straight away and only suspends when it would block. They work on the raw
+                stream and skip framing and write buffering */
+            class AsyncRead;
+            class AsyncWrite;
+            class AsyncAccept;
+
+            /* co_await gives the number of bytes read into msg, 0 once the peer closed the connection */
+            auto async_read(void *msg, const std::size_t size) -> AsyncRead;
+
+            /* co_await gives the number of bytes read into buf, 0 once the peer closed the connection */
+            auto async_read(std::span<char> buf) -> AsyncRead;
+
+            /* co_await gives size once all of msg has been sent */
+            auto async_write(const void *msg, const std::size_t size) -> AsyncWrite;
+
+            /* co_await gives buf.size() once all of buf has been sent */
+            auto async_write(std::span<const char> buf) -> AsyncWrite;
+
+            /* co_await gives the next connection on a server, in non-blocking mode */
+            auto async_accept() -> AsyncAccept;
     };
 } // namespace jj
 
@@ -0,0 +1,467 @@
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "common.hh"
+#include "endpoint.hh"
+#include "reactor.hh"
+#include "tcp.hh"
+#include "uring.hh"
+
+/*  Every test is a function that throws on failure, main runs the one named on the command line or all of them.
+    CMake registers each name as its own test so ctest reports them separately */
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+    /* Thrown by a test that can not run here, e.g. when the kernel has io_uring turned off */
+    struct Skip
+    {
+        std::string reason;
+    };
+
+    /* Exit code ctest is told to report as skipped */
+    constexpr int SKIPPED = 77;
+
+    /* The port the kernel picked for a listener bound to port 0 */
+    auto bound_port(const jj::TCP &listener) -> std::string
+    {
+        struct sockaddr_storage addr = {};
+        socklen_t len = sizeof(addr);
+        jj::assert_throw(getsockname(listener.fd(), reinterpret_cast<struct sockaddr *>(&addr), &len) == 0,
+                         "Failed to get bound address");
+        return std::to_string(jj::Endpoint(reinterpret_cast<struct sockaddr *>(&addr), len).port());
+    }
+
+    /* A connected client and accepted connection over loopback */
+    auto connected_pair() -> std::pair<jj::TCP, jj::TCP>
+    {
+        jj::TCP listener("127.0.0.1", "0", jj::TCP::SERVER);
+        jj::TCP client("127.0.0.1", bound_port(listener), jj::TCP::CLIENT);
+        return {std::move(client), listener.accept_connection()};
+    }
+
+    /*  Calls expire from its own thread if it is not destroyed within timeout, so a test waiting on a loop that
+        never finishes fails instead of hanging */
+    class Watchdog
+    {
+        private:
+            std::promise<void> done;
+            std::thread thread;
+
+        public:
+            Watchdog(const Clock::duration timeout, std::function<void()> expire)
+                : thread(
+                      [ready = done.get_future(), timeout, expire = std::move(expire)]
+                      {
+                          if (ready.wait_for(timeout) == std::future_status::timeout)
+                          {
+                              expire();
+                          }
+                      })
+            {
+            }
+
+            ~Watchdog()
+            {
+                done.set_value();
+                thread.join();
+            }
+    };
+
+    /* Runs a client on its own thread, rethrowing what it threw once joined */
+    class Client
+    {
+        private:
+            std::exception_ptr error;
+            std::thread thread;
+
+        public:
+            explicit Client(std::function<void()> body)
+                : thread(
+                      [this, body = std::move(body)]
+                      {
+                          try
+                          {
+                              body();
+                          }
+                          catch (...)
+                          {
+                              error = std::current_exception();
+                          }
+                      })
+            {
+            }
+
+            ~Client()
+            {
+                if (thread.joinable())
+                {
+                    thread.join();
+                }
+            }
+
+            auto join() -> void
+            {
+                thread.join();
+                if (error)
+                {
+                    std::rethrow_exception(error);
+                }
+            }
+    };
+
+    /* Runs call and checks it throws TimeoutError after roughly timeout, not at once and not much later */
+    auto expect_timeout(const std::string &what, const Clock::duration timeout, const std::function<void()> &call)
+        -> void
+    {
+        Clock::time_point start = Clock::now();
+        try
+        {
+            call();
+        }
+        catch (const jj::TimeoutError &)
+        {
+            Clock::duration elapsed = Clock::now() - start;
+            jj::assert_throw(elapsed >= timeout && elapsed < timeout + 2s, what + " timed out at the wrong time");
+            return;
+        }
+        throw std::runtime_error(what + " did not time out");
+    }
+
+    /* Frames of sizes around every varint boundary come back whole and in order */
+    auto framing_round_trip() -> void
+    {
+        auto [client, conn] = connected_pair();
+        client.set_framing(jj::TCP::LENGTH_PREFIXED);
+        conn.set_framing(jj::TCP::LENGTH_PREFIXED);
+
+        std::vector<std::size_t> sizes = {0, 1, 127, 128, 16383, 16384, 300000};
+        std::thread writer(
+            [&client, &sizes]
+            {
+                for (std::size_t size : sizes)
+                {
+                    client.write_frame(std::string(size, static_cast<char>('a' + size % 26)).data(), size);
+                }
+            });
+        for (std::size_t size : sizes)
+        {
+            std::string_view frame = conn.read_frame();
+            jj::assert_throw(frame == std::string(size, static_cast<char>('a' + size % 26)),
+                             "Frame of " + std::to_string(size) + " bytes came back different");
+        }
+        writer.join();
+
+        conn.set_nonblocking(true);
+        jj::assert_throw(!conn.poll_frame(), "poll_frame returned a frame nobody sent");
+        client.write_frame("xyz", 3);
+        std::optional<std::string_view> frame;
+        for (Clock::time_point deadline = Clock::now() + 2s; !frame && Clock::now() < deadline;)
+        {
+            frame = conn.poll_frame();
+        }
+        jj::assert_throw(frame && *frame == "xyz", "poll_frame missed a frame");
+    }
+
+    /* Buffered writes stay local until flushed and then arrive in the order they were written */
+    auto buffered_flush_order() -> void
+    {
+        auto [client, conn] = connected_pair();
+        client.set_buffered(64);
+        conn.set_nonblocking(true);
+
+        client.send_all("ab", 2);
+        client.send_all("cd", 2);
+        jj::assert_throw(client.buffered() == 4, "Buffered writes were not kept in the buffer");
+        char byte;
+        auto early = conn.try_read(&byte, 1);
+        jj::assert_throw(!early && early.error() == std::errc::resource_unavailable_try_again,
+                         "Buffered writes went out before a flush");
+
+        /* Overflows the buffer, which has to send what is buffered ahead of it */
+        std::string big(100, 'x');
+        client.send_all(big.data(), big.size());
+        jj::assert_throw(client.buffered() == 0, "A write that overflowed the buffer left data behind");
+        client.send_all("ef", 2);
+        client.flush();
+        jj::assert_throw(client.buffered() == 0, "flush left data behind");
+
+        std::string expected = "abcd" + big + "ef";
+        std::string got(expected.size(), '\0');
+        conn.recv_exact(got.data(), got.size(), Clock::now() + 2s);
+        jj::assert_throw(got == expected, "Buffered writes arrived out of order");
+    }
+
+    /* A reactor accepts a connection, echoes what it reads and closes the connection when the peer does */
+    auto reactor_accept_read_close() -> void
+    {
+        jj::Reactor reactor;
+        jj::TCP &listener = reactor.add(
+            jj::TCP("127.0.0.1", "0", jj::TCP::SERVER), jj::Reactor::READABLE,
+            [](jj::Reactor &reactor, jj::TCP &listener, std::uint32_t)
+            {
+                std::vector<jj::TCP> accepted;
+                listener.accept_all(accepted);
+                for (jj::TCP &tcp : accepted)
+                {
+                    reactor.add(std::move(tcp), jj::Reactor::READABLE,
+                                [](jj::Reactor &reactor, jj::TCP &tcp, std::uint32_t)
+                                {
+                                    char buf[256];
+                                    auto nbytes = tcp.try_read(buf, sizeof(buf));
+                                    if (!nbytes)
+                                    {
+                                        return;
+                                    }
+                                    if (*nbytes == 0)
+                                    {
+                                        reactor.remove(tcp);
+                                        reactor.stop();
+                                        return;
+                                    }
+                                    jj::assert_throw(tcp.try_write(buf, *nbytes) == *nbytes, "Short echo");
+                                });
+                }
+            });
+        Client client(
+            [port = bound_port(listener)]
+            {
+                jj::TCP client("127.0.0.1", port, jj::TCP::CLIENT);
+                client.send_all("hello", 5);
+                char echo[5];
+                client.recv_exact(echo, sizeof(echo), Clock::now() + 2s);
+                jj::assert_throw(std::string(echo, sizeof(echo)) == "hello", "Reactor echoed the wrong data");
+            });
+        {
+            Watchdog watchdog(5s, [&reactor] { reactor.stop(); });
+            reactor.run();
+        }
+        client.join();
+        jj::assert_throw(reactor.size() == 1, "Reactor kept the closed connection");
+    }
+
+    /* A ring accepts a connection and receives everything sent on it, followed by the close */
+    auto uring_accept_recv() -> void
+    {
+        std::optional<jj::Uring> ring;
+        try
+        {
+            ring.emplace(16, 8, 4096);
+        }
+        catch (const std::runtime_error &e)
+        {
+            throw Skip{e.what()};
+        }
+
+        jj::TCP listener("127.0.0.1", "0", jj::TCP::SERVER);
+        std::list<jj::TCP> conns;
+        std::string received;
+        bool closed = false;
+        std::error_code accept_error;
+        ring->accept_multishot(
+            listener,
+            [&](jj::Uring &ring, std::expected<jj::TCP, std::error_code> tcp)
+            {
+                if (!tcp)
+                {
+                    accept_error = tcp.error();
+                    ring.stop();
+                    return;
+                }
+                ring.recv_multishot(conns.emplace_back(std::move(*tcp)),
+                                    [&](jj::Uring &ring, jj::TCP &, std::span<const std::byte> data, std::error_code)
+                                    {
+                                        if (data.empty())
+                                        {
+                                            closed = true;
+                                            ring.stop();
+                                            return;
+                                        }
+                                        received.append(reinterpret_cast<const char *>(data.data()), data.size());
+                                    });
+            });
+
+        Client client(
+            [port = bound_port(listener)]
+            {
+                jj::TCP client("127.0.0.1", port, jj::TCP::CLIENT);
+                client.send_all("hello ", 6);
+                client.send_all("uring", 5);
+            });
+        {
+            Watchdog watchdog(5s, [&ring] { ring->stop(); });
+            ring->run();
+        }
+        client.join();
+
+        jj::assert_throw(!accept_error, "Accept failed: " + accept_error.message());
+        jj::assert_throw(closed, "The close was not reported");
+        jj::assert_throw(received == "hello uring", "Ring received the wrong data: " + received);
+    }
+
+    /* Numeric addresses with and without brackets and scopes, and Unix paths in both namespaces */
+    auto endpoint_parser() -> void
+    {
+        jj::Endpoint v4("127.0.0.1", "80");
+        jj::assert_throw(v4.family() == AF_INET && v4.port() == 80, "IPv4 address parsed wrong");
+        jj::assert_throw(v4.to_string() == "127.0.0.1:80", "IPv4 address printed wrong");
+        jj::assert_throw(jj::Endpoint("", "80").address() == "0.0.0.0", "Empty address is not the wildcard");
+
+        jj::Endpoint v6("::1", "443");
+        jj::Endpoint bracketed("[::1]", "443");
+        jj::assert_throw(v6.family() == AF_INET6 && v6 == bracketed, "Brackets changed the IPv6 address");
+        jj::assert_throw(bracketed.to_string() == "[::1]:443", "IPv6 address printed wrong");
+        jj::assert_throw(std::hash<jj::Endpoint>{}(v6) == std::hash<jj::Endpoint>{}(bracketed),
+                         "Equal endpoints hash differently");
+
+        unsigned loopback = if_nametoindex("lo");
+        if (loopback != 0)
+        {
+            for (const std::string ip : {"fe80::1%lo", "[fe80::1%lo]"})
+            {
+                jj::Endpoint scoped(ip, "22");
+                const auto *sa = reinterpret_cast<const struct sockaddr_in6 *>(scoped.data());
+                jj::assert_throw(sa->sin6_scope_id == loopback && scoped.address() == "fe80::1",
+                                 "Scoped address parsed wrong: " + ip);
+            }
+        }
+
+        for (auto [ip, port] : std::vector<std::pair<std::string, std::string>>{
+                 {"fe80::1%no-such-interface", "22"}, {"1.2.3", "22"}, {"[::1", "22"}, {"::1", "65536"},
+                 {"::1", "22x"}, {"::1", ""}})
+        {
+            bool threw = false;
+            try
+            {
+                jj::Endpoint parsed(ip, port);
+            }
+            catch (const std::runtime_error &)
+            {
+                threw = true;
+            }
+            jj::assert_throw(threw, "Accepted invalid endpoint " + ip + " port " + port);
+        }
+
+        jj::Endpoint path = jj::Endpoint::local("/tmp/jj.sock");
+        jj::assert_throw(path.family() == AF_UNIX && path.address() == "/tmp/jj.sock", "Unix path parsed wrong");
+        jj::assert_throw(path.size() == offsetof(struct sockaddr_un, sun_path) + 13, "Unix path length is wrong");
+
+        std::string name = "@jj-tests-" + std::to_string(getpid());
+        jj::Endpoint abstract = jj::Endpoint::local(name);
+        jj::assert_throw(abstract.address() == name && abstract.to_string() == name, "Abstract name parsed wrong");
+        jj::assert_throw(abstract.size() == offsetof(struct sockaddr_un, sun_path) + name.size(),
+                         "Abstract name must not count a terminating null");
+
+        jj::TCP listener(abstract, jj::TCP::SERVER);
+        jj::TCP client(abstract, jj::TCP::CLIENT);
+        jj::TCP conn = listener.accept_connection();
+        client.send_all("unix", 4);
+        char buf[4];
+        conn.recv_exact(buf, sizeof(buf), Clock::now() + 2s);
+        jj::assert_throw(std::string(buf, sizeof(buf)) == "unix", "Abstract socket delivered the wrong data");
+    }
+
+    /* Reads, frame reads and writes give up with TimeoutError once their deadline or timeout passes */
+    auto deadline_timeouts() -> void
+    {
+        auto [client, conn] = connected_pair();
+        char buf[16];
+
+        expect_timeout("read", 100ms, [&] { conn.read(buf, sizeof(buf), Clock::now() + 100ms); });
+        expect_timeout("recv_exact", 100ms, [&] { conn.recv_exact(buf, sizeof(buf), Clock::now() + 100ms); });
+
+        conn.set_timeout(100ms);
+        client.send_all("part", 4);
+        expect_timeout("recv_exact with a timeout", 100ms, [&] { conn.recv_exact(buf, sizeof(buf)); });
+        conn.set_timeout({});
+
+        auto [framed_client, framed] = connected_pair();
+        framed_client.set_framing(jj::TCP::LENGTH_PREFIXED);
+        framed.set_framing(jj::TCP::LENGTH_PREFIXED);
+        unsigned char header = 10;
+        framed_client.send_all(&header, 1);
+        framed_client.send_all("half", 4);
+        expect_timeout("read_frame", 100ms, [&] { framed.read_frame(Clock::now() + 100ms); });
+        framed_client.send_all("-frame", 6);
+        jj::assert_throw(framed.read_frame(Clock::now() + 2s) == "half-frame",
+                         "A frame cut short by a timeout was not picked up again");
+
+        /* Nobody reads conn, so the send buffers fill up long before this is all sent */
+        std::string flood(64 << 20, 'x');
+        expect_timeout("send_all", 100ms, [&] { client.send_all(flood.data(), flood.size(), Clock::now() + 100ms); });
+    }
+
+    struct Test
+    {
+        const char *name;
+        void (*run)();
+    };
+
+    const Test TESTS[] = {
+        {"framing_round_trip", framing_round_trip},
+        {"buffered_flush_order", buffered_flush_order},
+        {"reactor_accept_read_close", reactor_accept_read_close},
+        {"uring_accept_recv", uring_accept_recv},
+        {"endpoint_parser", endpoint_parser},
+        {"deadline_timeouts", deadline_timeouts},
+    };
+} // namespace
+
+auto main(int argc, char **argv) -> int
+{
+    int failed = 0;
+    int ran = 0;
+    bool skipped = false;
+    for (const Test &test : TESTS)
+    {
+        if (argc > 1 && std::strcmp(argv[1], test.name) != 0)
+        {
+            continue;
+        }
+        ++ran;
+        try
+        {
+            test.run();
+            std::printf("PASS %s\n", test.name);
+        }
+        catch (const Skip &skip)
+        {
+            skipped = true;
+            std::printf("SKIP %s: %s\n", test.name, skip.reason.c_str());
+        }
+        catch (const std::exception &e)
+        {
+            ++failed;
+            std::printf("FAIL %s: %s\n", test.name, e.what());
+        }
+    }
+    if (ran == 0)
+    {
+        std::printf("No test named %s\n", argv[1]);
+        return 1;
+    }
+    if (failed != 0)
+    {
+        return 1;
+    }
+    return skipped && ran == 1 ? SKIPPED : 0;
+}
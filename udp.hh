@@ -3,31 +3,28 @@
 
 #include <algorithm>
 #include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
 #include <cstddef>
 #include <cstring>
+#include <expected>
+#include <poll.h>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <system_error>
 #include <unistd.h>
 #include <vector>
 
+#include "common.hh"
+#include "endpoint.hh"
+#include "sockopt.hh"
+#include "stats.hh"
+
 namespace jj
 {
-    inline auto assert_throw(bool condition, const std::string &msg) -> void
-    {
-        if (condition == false)
-        {
-            throw std::runtime_error(msg);
-        }
-    }
-
-    inline auto operator<<(std::vector<char> &vec, const std::string str) -> std::vector<char> &
-    {
-        std::copy(str.begin(), str.end() + 1, vec.begin());
-        return vec;
-    }
-
     /*  A header only wrapper around the C-Style UDP Socket API */
     class UDP
     {
@@ -40,36 +37,139 @@ namespace jj
 
         private:
             int sock_fd = 0;
-            struct sockaddr_in sock_conf = {0};
+            struct sockaddr_storage sock_conf = {};
             socklen_t sock_conf_len = sizeof(struct sockaddr_in);
+            int sock_family = AF_INET;
             Side side;
 
+            /* Timeout given to reads that have no deadline of their own, zero waits forever */
+            std::chrono::steady_clock::duration io_timeout{};
+
+            /* Hot path counters, empty unless built with JJ_SOCKET_STATS */
+            [[no_unique_address]] SocketStats stats{SocketStats::UDP};
+
+            /* Sends to the current destination */
+            auto send_to_peer(const void *msg, const std::size_t size, const int flags = 0) -> ssize_t
+            {
+                struct sockaddr *to = (struct sockaddr *)&sock_conf;
+                return stats.send(size, [&] { return sendto(sock_fd, msg, size, flags, to, sock_conf_len); });
+            }
+
+            /*  Receives one datagram and makes its sender the current destination. The sender is only taken
+                when a datagram arrived, a failed or would-block receive leaves the destination as it was */
+            auto recv_from_peer(void *msg, const std::size_t size, const int flags = 0) -> ssize_t
+            {
+                struct sockaddr_storage from;
+                socklen_t from_len = sizeof(from);
+                struct sockaddr *addr = (struct sockaddr *)&from;
+                ssize_t nbytes = stats.recv(size, [&] { return recvfrom(sock_fd, msg, size, flags, addr, &from_len); });
+                if (nbytes >= 0)
+                {
+                    std::memcpy(&sock_conf, &from, from_len);
+                    sock_conf_len = from_len;
+                }
+                return nbytes;
+            }
+
+            /*  recv_from_peer that gives up at deadline. Without one it is the plain blocking call, with one the
+                socket is tried with MSG_DONTWAIT first and poll only runs when nothing is queued, so a deadline
+                costs nothing while datagrams keep coming. Returns -1 with errno set to ETIMEDOUT once the
+                deadline passes */
+            auto recv_until(void *msg, const std::size_t size, const std::chrono::steady_clock::time_point deadline)
+                -> ssize_t
+            {
+                int flags = deadline == NO_DEADLINE ? 0 : MSG_DONTWAIT;
+                while (true)
+                {
+                    ssize_t nbytes = recv_from_peer(msg, size, flags);
+                    if (nbytes != -1)
+                    {
+                        return nbytes;
+                    }
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if ((errno != EAGAIN && errno != EWOULDBLOCK) || !wait_fd(sock_fd, POLLIN, deadline))
+                    {
+                        return -1;
+                    }
+                }
+            }
+
+            /* The deadline of a read starting now that was not given one, from set_timeout */
+            auto default_deadline() const -> std::chrono::steady_clock::time_point
+            {
+                if (io_timeout == std::chrono::steady_clock::duration::zero())
+                {
+                    return NO_DEADLINE;
+                }
+                return std::chrono::steady_clock::now() + io_timeout;
+            }
+
+            /* Throws for a read that failed with errno, a passed deadline as a TimeoutError */
+            static auto check_read(const ssize_t nbytes) -> void
+            {
+                if (nbytes == -1 && errno == ETIMEDOUT)
+                {
+                    throw TimeoutError("Timed out reading from socket");
+                }
+                assert_throw(nbytes != -1, "Failed to read from socket");
+            }
+
         public:
-            /*  Create a new UDP object, if side == 0 then client, and side == 1 then server */
-            UDP(const std::string ip_addr, const std::string port, const Side &side) : side(side)
+            /*  Create a new UDP object, if side == 0 then client, and side == 1 then server. A server binds to
+                ip_addr, every IPv4 address if it is empty, and a client sends to it */
+            UDP(const std::string ip_addr, const std::string port, const Side &side)
+                : UDP(Endpoint(ip_addr, port), side)
             {
-                sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+            }
+
+            /*  Create a new UDP object on a parsed endpoint. A server on "::" is dual-stack and also receives from
+                IPv4 peers. With Endpoint::local it is a Unix datagram socket, clients are bound to an autogenerated
+                abstract address so the server has somewhere to reply to */
+            UDP(const Endpoint &endpoint, const Side &side) : side(side)
+            {
+                sock_family = endpoint.family();
+                sock_fd = socket(sock_family, SOCK_DGRAM, 0);
                 assert_throw(this->sock_fd != -1, "Failed to create socket");
+                stats.set_fd(sock_fd);
 
-                sock_conf.sin_family = AF_INET;
-                sock_conf.sin_port = htons(std::stoul(port));
-                sock_conf_len = sizeof(sock_conf);
+                std::memcpy(&sock_conf, endpoint.data(), endpoint.size());
+                sock_conf_len = endpoint.size();
 
                 if (side == Side::SERVER)
                 {
-                    sock_conf.sin_addr.s_addr = INADDR_ANY;
+                    if (endpoint.is_v6_any())
+                    {
+                        int value = 0;
+                        int ret = setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &value, sizeof(value));
+                        assert_throw(ret != -1, "Failed to set IPV6_V6ONLY");
+                    }
+                    endpoint.unlink_socket();
                     int ret = bind(sock_fd, (struct sockaddr *)&sock_conf, sock_conf_len);
                     assert_throw(ret != -1, "Failed to bind to port");
                 }
-                else if (side == Side::CLIENT)
+                else if (sock_family == AF_UNIX)
                 {
-                    sock_conf.sin_addr.s_addr = inet_addr(ip_addr.c_str());
+                    sa_family_t autobind = AF_UNIX;
+                    int ret = bind(sock_fd, (struct sockaddr *)&autobind, sizeof(autobind));
+                    assert_throw(ret != -1, "Failed to bind Unix socket");
                 }
             }
 
-            /* Closes the socket */
+            /* Closes the socket, a server on a Unix socket path also removes its socket file */
             ~UDP()
             {
+                if (side == Side::SERVER && sock_family == AF_UNIX)
+                {
+                    struct sockaddr_storage bound = {};
+                    socklen_t bound_len = sizeof(bound);
+                    if (getsockname(sock_fd, (struct sockaddr *)&bound, &bound_len) == 0)
+                    {
+                        Endpoint((const struct sockaddr *)&bound, bound_len).unlink_socket();
+                    }
+                }
                 close(sock_fd);
             }
 
@@ -77,15 +177,18 @@ namespace jj
             UDP(const UDP &obj) = delete;
 
             /* UDP move constructor */
-            UDP(UDP &&obj)
+            UDP(UDP &&obj) : stats(std::move(obj.stats))
             {
                 sock_fd = obj.sock_fd;
                 sock_conf = obj.sock_conf;
                 sock_conf_len = obj.sock_conf_len;
+                sock_family = obj.sock_family;
                 side = obj.side;
+                io_timeout = obj.io_timeout;
 
                 obj.sock_fd = -1;
-                std::fill((std::byte *)&sock_conf, (std::byte *)&sock_conf + sizeof(sock_conf), std::byte{0});
+                std::fill((std::byte *)&obj.sock_conf, (std::byte *)&obj.sock_conf + sizeof(obj.sock_conf),
+                          std::byte{0});
                 obj.sock_conf_len = -1;
             }
 
@@ -100,10 +203,14 @@ namespace jj
                 sock_fd = obj.sock_fd;
                 sock_conf = obj.sock_conf;
                 sock_conf_len = obj.sock_conf_len;
+                sock_family = obj.sock_family;
                 side = obj.side;
+                io_timeout = obj.io_timeout;
+                stats = std::move(obj.stats);
 
                 obj.sock_fd = -1;
-                std::fill((std::byte *)&sock_conf, (std::byte *)&sock_conf + sizeof(sock_conf), std::byte{0});
+                std::fill((std::byte *)&obj.sock_conf, (std::byte *)&obj.sock_conf + sizeof(obj.sock_conf),
+                          std::byte{0});
                 obj.sock_conf_len = -1;
 
                 return *this;
@@ -112,21 +219,92 @@ namespace jj
             /* UDP should not be copied, since this is undefined behavior */
             auto operator=(const UDP &obj) -> UDP & = delete;
 
+            /* The underlying file descriptor, for use with poll, epoll and the like */
+            auto fd() const -> int
+            {
+                return sock_fd;
+            }
+
+            /*  Gives every read that has no deadline of its own, operator>> and read, a deadline of timeout from
+                when it starts, so a lost datagram ends in a TimeoutError instead of waiting forever. Zero, the
+                default, waits forever */
+            auto set_timeout(const std::chrono::steady_clock::duration timeout) -> void
+            {
+                io_timeout = timeout;
+            }
+
+            /* The timeout set with set_timeout, zero if there is none */
+            auto get_timeout() const -> std::chrono::steady_clock::duration
+            {
+                return io_timeout;
+            }
+
+            /* Sets a typed socket option, e.g. set_option<sockopt::RecvBuffer>(4 << 20) */
+            template <typename O> auto set_option(const typename O::value_type value) -> void
+            {
+                static_assert(O::udp, "Option does not apply to UDP sockets");
+                int ret = sockopt::set<O>(sock_fd, value);
+                assert_throw(ret != -1, "Failed to set socket option");
+            }
+
+            /* Reads a typed socket option, e.g. get_option<sockopt::RecvBuffer>() */
+            template <typename O> auto get_option() const -> typename O::value_type
+            {
+                static_assert(O::udp, "Option does not apply to UDP sockets");
+                return sockopt::get<O>(sock_fd);
+            }
+
+            /*  Sets the options of a named profile in one call, options the process lacks the privileges for are
+                skipped */
+            auto set_profile(const sockopt::Profile profile) -> void
+            {
+                sockopt::apply(sock_fd, profile, sock_conf.ss_family, false);
+            }
+
             /*  UDP is pretty crazy, since the same socket can still send messages too, might as well
                 use this feature to implement stuff like reply */
             auto new_connection(const std::string &ip_addr, const std::string &port) -> void
             {
-                sock_conf.sin_family = AF_INET;
-                sock_conf.sin_port = htons(std::stoul(port));
-                sock_conf_len = sizeof(sock_conf);
-                sock_conf.sin_addr.s_addr = inet_addr(ip_addr.c_str());
+                new_connection(Endpoint(ip_addr, port));
+            }
+
+            /* Same as above with an endpoint parsed ahead of time, so switching destinations never parses */
+            auto new_connection(const Endpoint &endpoint) -> void
+            {
+                Endpoint target = endpoint.for_family(sock_family);
+                std::memcpy(&sock_conf, target.data(), target.size());
+                sock_conf_len = target.size();
+            }
+
+            /*  The current destination, which is the sender of the last datagram after a read. Responders can
+                keep it to reply later */
+            auto peer() const -> Endpoint
+            {
+                return Endpoint((const struct sockaddr *)&sock_conf, sock_conf_len);
+            }
+
+            /*  Sends msg to endpoint without changing the current destination, for responders that answer a
+                different peer with every packet. IPv4 endpoints on an IPv6 socket are mapped on every call, so
+                store them already mapped with Endpoint::for_family to skip that */
+            auto write_to(const Endpoint &endpoint, const void *msg, const std::size_t size) -> ssize_t
+            {
+                Endpoint mapped;
+                const Endpoint *target = &endpoint;
+                if (endpoint.family() != sock_family)
+                {
+                    mapped = endpoint.for_family(sock_family);
+                    target = &mapped;
+                }
+                ssize_t nbytes =
+                    stats.send(size, [&] { return sendto(sock_fd, msg, size, 0, target->data(), target->size()); });
+                assert_throw(nbytes != -1, "Failed to write to socket");
+                return nbytes;
             }
 
             /* Takes a vector obj and sends it through the socket */
             template <typename T> friend auto operator<<(UDP &udp, const std::vector<T> &obj) -> UDP &
             {
-                int nbytes = sendto(udp.sock_fd, obj.data(), obj.size() * sizeof(T), 0,
-                                    (struct sockaddr *)&udp.sock_conf, udp.sock_conf_len);
+                int nbytes = udp.send_to_peer(obj.data(), obj.size() * sizeof(T));
                 assert_throw(nbytes != -1, "Failed to write to socket");
                 return udp;
             }
@@ -136,9 +314,8 @@ namespace jj
             template <typename T> friend auto operator>>(UDP &udp, std::vector<T> &obj) -> UDP &
             {
                 obj.resize(obj.capacity());
-                int nbytes = recvfrom(udp.sock_fd, obj.data(), obj.capacity() * sizeof(T), 0,
-                                      (struct sockaddr *)&udp.sock_conf, &udp.sock_conf_len);
-                assert_throw(nbytes != -1, "Failed to read from socket");
+                ssize_t nbytes = udp.recv_until(obj.data(), obj.capacity() * sizeof(T), udp.default_deadline());
+                check_read(nbytes);
                 obj.resize(nbytes / sizeof(T));
                 return udp;
             }
@@ -146,8 +323,7 @@ namespace jj
             /*  Takes a string obj and writes it to the socket */
             friend auto operator<<(UDP &udp, const std::string &obj) -> UDP &
             {
-                int nbytes = sendto(udp.sock_fd, obj.c_str(), obj.size() + 1, 0, (struct sockaddr *)&udp.sock_conf,
-                                    udp.sock_conf_len);
+                int nbytes = udp.send_to_peer(obj.c_str(), obj.size() + 1);
                 assert_throw(nbytes != -1, "Failed to write to socket");
                 return udp;
             }
@@ -157,10 +333,9 @@ namespace jj
                 Since resize trucates the string, ensure that it is resized upon reuse. */
             friend auto operator>>(UDP &udp, std::string &obj) -> UDP &
             {
-                int nbytes = recvfrom(udp.sock_fd, obj.data(), obj.capacity(), 0, (struct sockaddr *)&udp.sock_conf,
-                                      &udp.sock_conf_len);
+                ssize_t nbytes = udp.recv_until(obj.data(), obj.capacity(), udp.default_deadline());
+                check_read(nbytes);
                 obj.resize(nbytes);
-                assert_throw(nbytes != -1, "Failed to read from socket");
                 return udp;
             }
 
@@ -169,8 +344,7 @@ namespace jj
                 and size of the object */
             template <typename T> friend auto operator<<(UDP &udp, const T &obj) -> UDP &
             {
-                int nbytes =
-                    sendto(udp.sock_fd, &obj, sizeof(T), 0, (struct sockaddr *)&udp.sock_conf, udp.sock_conf_len);
+                int nbytes = udp.send_to_peer(&obj, sizeof(T));
 
                 assert_throw(nbytes != -1, "Failed to write to socket");
                 return udp;
@@ -181,16 +355,15 @@ namespace jj
                 and size of the object */
             template <typename T> friend auto operator>>(UDP &udp, T &obj) -> UDP &
             {
-                int nbytes =
-                    recvfrom(udp.sock_fd, &obj, sizeof(obj), 0, (struct sockaddr *)&udp.sock_conf, &udp.sock_conf_len);
-                assert_throw(nbytes != -1, "Failed to read from socket");
+                ssize_t nbytes = udp.recv_until(&obj, sizeof(obj), udp.default_deadline());
+                check_read(nbytes);
                 return udp;
             }
 
             /* A direct wrapper around the underlying send function */
             auto write(const void *msg, const std::size_t size) -> ssize_t
             {
-                int nbytes = sendto(sock_fd, msg, size, 0, (struct sockaddr *)&sock_conf, sock_conf_len);
+                int nbytes = send_to_peer(msg, size);
 
                 assert_throw(nbytes != -1, "Failed to write to socket");
                 return nbytes;
@@ -199,10 +372,82 @@ namespace jj
             /* A direct wrapper around the underlying write function */
             auto read(void *msg, std::size_t size) -> ssize_t
             {
-                int nbytes = recvfrom(sock_fd, msg, size, 0, (struct sockaddr *)&sock_conf, &sock_conf_len);
-                assert_throw(nbytes != -1, "Failed to read from socket");
+                return read(msg, size, default_deadline());
+            }
+
+            /*  Reads the next datagram, waiting for one until deadline and then throwing TimeoutError, so a
+                request or reply lost on the way can be detected and sent again */
+            auto read(void *msg, const std::size_t size, const std::chrono::steady_clock::time_point deadline)
+                -> ssize_t
+            {
+                ssize_t nbytes = recv_until(msg, size, deadline);
+                check_read(nbytes);
+                return nbytes;
+            }
+
+            /* Same as above with a deadline timeout from now */
+            auto read_for(void *msg, const std::size_t size, const std::chrono::steady_clock::duration timeout)
+                -> ssize_t
+            {
+                return read(msg, size, std::chrono::steady_clock::now() + timeout);
+            }
+
+            /*  Non-throwing version of write, errors come back as the errno they were raised with so a full
+                send buffer costs nothing beyond the syscall */
+            auto try_write(const void *msg, const std::size_t size) noexcept
+                -> std::expected<std::size_t, std::error_code>
+            {
+                ssize_t nbytes = send_to_peer(msg, size);
+                if (nbytes == -1)
+                {
+                    return std::unexpected(std::error_code(errno, std::system_category()));
+                }
                 return nbytes;
             }
+
+            /*  Non-throwing version of read, the sender becomes the destination for replies like with read.
+                Errors come back as the errno they were raised with */
+            auto try_read(void *msg, const std::size_t size) noexcept -> std::expected<std::size_t, std::error_code>
+            {
+                ssize_t nbytes = recv_from_peer(msg, size);
+                if (nbytes == -1)
+                {
+                    return std::unexpected(std::error_code(errno, std::system_category()));
+                }
+                return nbytes;
+            }
+
+            /*  Non-throwing version of read with a deadline, gives std::errc::timed_out once it passes without a
+                datagram arriving */
+            auto try_read(void *msg, const std::size_t size,
+                          const std::chrono::steady_clock::time_point deadline) noexcept
+                -> std::expected<std::size_t, std::error_code>
+            {
+                ssize_t nbytes = recv_until(msg, size, deadline);
+                if (nbytes == -1)
+                {
+                    return std::unexpected(std::error_code(errno, std::system_category()));
+                }
+                return nbytes;
+            }
+
+            /*  Awaitable operations for coroutines running on an EventLoop, they are defined in async.hh. Each
+                one tries the syscall straight away and only suspends when it would block */
+            class AsyncRecvFrom;
+            class AsyncSendTo;
+
+            /*  co_await gives the size of the next datagram read into msg, the sender becomes the destination
+                for replies like with operator>> */
+            auto async_recv_from(void *msg, const std::size_t size) -> AsyncRecvFrom;
+
+            /* Same as above, reading into buf */
+            auto async_recv_from(std::span<char> buf) -> AsyncRecvFrom;
+
+            /* co_await gives the number of bytes sent to the current destination */
+            auto async_send_to(const void *msg, const std::size_t size) -> AsyncSendTo;
+
+            /* Same as above, sending buf */
+            auto async_send_to(std::span<const char> buf) -> AsyncSendTo;
     };
 } // namespace jj
 
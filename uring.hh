@@ -0,0 +1,577 @@
+#ifndef URING_HH
+#define URING_HH
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <functional>
+#include <linux/io_uring.h>
+#include <span>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tcp.hh"
+
+namespace jj
+{
+    /*  A completion based alternative to the Reactor that drives TCP sockets through io_uring. Operations are
+        queued into the submission ring and go to the kernel together on the next poll, so one io_uring_enter
+        carries a whole batch. Accepts and receives are multishot, receives land in a ring of provided buffers
+        owned by this object. Sockets must outlive the operations queued on them. */
+    class Uring
+    {
+        public:
+            /*  Called with every new connection from accept_multishot. An error means the listener can not accept
+                anymore, e.g. EMFILE or EBADF, and is the last call for that listener */
+            using AcceptHandler = std::function<void(Uring &, std::expected<TCP, std::error_code>)>;
+
+            /*  Called with every chunk received by recv_multishot, the data is only valid until the handler
+                returns. An empty chunk means the peer closed the connection, or the receive failed with the
+                error given, e.g. when the peer reset it. Either way it is the last call for that socket */
+            using RecvHandler = std::function<void(Uring &, TCP &, std::span<const std::byte>, std::error_code)>;
+
+            /* Called once a send has completed, with the number of bytes sent or -errno */
+            using SendHandler = std::function<void(Uring &, TCP &, ssize_t)>;
+
+        private:
+            enum Kind
+            {
+                ACCEPT,
+                RECV,
+                SEND
+            };
+
+            struct Op
+            {
+                Kind kind;
+                TCP *tcp;
+                AcceptHandler on_accept;
+                RecvHandler on_recv;
+                SendHandler on_send;
+                const std::byte *send_buf;
+                std::size_t send_len;
+                std::size_t send_done;
+                bool cancelled;
+            };
+
+            /* Buffer group used for every multishot receive */
+            static constexpr std::uint16_t BUFFER_GROUP = 0;
+
+            /* user_data of the read on wake_fd, ids of queued operations count up from 1 */
+            static constexpr std::uint64_t WAKE = ~std::uint64_t(0);
+
+            int ring_fd;
+            std::atomic<bool> stopping = false;
+
+            /* Written by stop to end a wait in io_uring_enter from another thread, a read on it is always queued */
+            int wake_fd = -1;
+            std::uint64_t wake_count;
+
+            void *sq_ptr = MAP_FAILED;
+            void *cq_ptr = MAP_FAILED;
+            std::size_t sq_size = 0;
+            std::size_t cq_size = 0;
+            struct io_uring_sqe *sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+            std::size_t sqes_size = 0;
+
+            unsigned *sq_head;
+            unsigned *sq_tail;
+            unsigned *sq_mask;
+            unsigned *sq_array;
+            unsigned sq_entries;
+            unsigned sq_local_tail;
+            unsigned to_submit = 0;
+
+            unsigned *cq_head;
+            unsigned *cq_tail;
+            unsigned *cq_mask;
+            struct io_uring_cqe *cqes;
+
+            struct io_uring_buf_ring *buf_ring = static_cast<struct io_uring_buf_ring *>(MAP_FAILED);
+            std::size_t buf_ring_size = 0;
+            std::byte *buffers = static_cast<std::byte *>(MAP_FAILED);
+            std::size_t buffers_size = 0;
+            unsigned buffer_count;
+            unsigned buffer_len;
+
+            std::uint64_t next_id = 1;
+            std::unordered_map<std::uint64_t, Op> ops;
+
+            /*  Operations cancelled while handlers run, erased once the batch is done so cancel can be called
+                from inside the handler that is running */
+            bool dispatching = false;
+            std::vector<std::uint64_t> graveyard;
+
+            /* Erases the operations cancelled during the last batch */
+            auto bury() -> void
+            {
+                for (std::uint64_t id : graveyard)
+                {
+                    ops.erase(id);
+                }
+                graveyard.clear();
+            }
+
+            static auto load_acquire(unsigned *p) -> unsigned
+            {
+                return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+            }
+
+            static auto store_release(unsigned *p, unsigned v) -> void
+            {
+                std::atomic_ref<unsigned>(*p).store(v, std::memory_order_release);
+            }
+
+            /* Hands buffer bid back to the kernel so it can be picked by the next receive */
+            auto recycle_buffer(unsigned bid) -> void
+            {
+                /* bufs is not used directly since the kernel header's flexible array sits at the wrong offset
+                    when compiled as C++ */
+                std::uint16_t &tail = buf_ring->tail;
+                auto *bufs = reinterpret_cast<struct io_uring_buf *>(buf_ring);
+                struct io_uring_buf &buf = bufs[tail & (buffer_count - 1)];
+                buf.addr = reinterpret_cast<std::uint64_t>(buffers + static_cast<std::size_t>(bid) * buffer_len);
+                buf.len = buffer_len;
+                buf.bid = bid;
+                std::atomic_ref<std::uint16_t>(tail).store(tail + 1, std::memory_order_release);
+            }
+
+            /* Reserves the next submission entry, flushing the ring to the kernel first if it is full */
+            auto next_sqe() -> struct io_uring_sqe *
+            {
+                if (sq_local_tail - load_acquire(sq_head) == sq_entries)
+                {
+                    submit();
+                }
+                assert_throw(sq_local_tail - load_acquire(sq_head) < sq_entries, "Submission ring is full");
+
+                unsigned idx = sq_local_tail & *sq_mask;
+                struct io_uring_sqe *sqe = &sqes[idx];
+                std::fill((std::byte *)sqe, (std::byte *)sqe + sizeof(*sqe), std::byte{0});
+                sq_array[idx] = idx;
+                ++sq_local_tail;
+                ++to_submit;
+                return sqe;
+            }
+
+            auto queue_wake() -> void
+            {
+                struct io_uring_sqe *sqe = next_sqe();
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = wake_fd;
+                sqe->addr = reinterpret_cast<std::uint64_t>(&wake_count);
+                sqe->len = sizeof(wake_count);
+                sqe->user_data = WAKE;
+            }
+
+            auto queue_accept(std::uint64_t id, int fd) -> void
+            {
+                struct io_uring_sqe *sqe = next_sqe();
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->fd = fd;
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+                sqe->accept_flags = SOCK_CLOEXEC;
+                sqe->user_data = id;
+            }
+
+            auto queue_recv(std::uint64_t id, int fd) -> void
+            {
+                struct io_uring_sqe *sqe = next_sqe();
+                sqe->opcode = IORING_OP_RECV;
+                sqe->fd = fd;
+                sqe->ioprio = IORING_RECV_MULTISHOT;
+                sqe->flags = IOSQE_BUFFER_SELECT;
+                sqe->buf_group = BUFFER_GROUP;
+                sqe->user_data = id;
+            }
+
+            auto queue_send(std::uint64_t id, const Op &op) -> void
+            {
+                struct io_uring_sqe *sqe = next_sqe();
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = op.tcp->fd();
+                sqe->addr = reinterpret_cast<std::uint64_t>(op.send_buf + op.send_done);
+                sqe->len = op.send_len - op.send_done;
+                sqe->msg_flags = MSG_NOSIGNAL;
+                sqe->user_data = id;
+            }
+
+            /* Runs the handler for one completion, returns false if the operation is finished */
+            auto complete(std::uint64_t id, Op &op, const struct io_uring_cqe &cqe) -> bool
+            {
+                bool more = cqe.flags & IORING_CQE_F_MORE;
+                switch (op.kind)
+                {
+                    case ACCEPT:
+                        if (cqe.res >= 0)
+                        {
+                            struct sockaddr_storage peer = {};
+                            socklen_t peer_len = sizeof(peer);
+                            getpeername(cqe.res, (struct sockaddr *)&peer, &peer_len);
+                            op.on_accept(*this, TCP(cqe.res, peer, false));
+                        }
+                        else if (cqe.res != -ENOBUFS && cqe.res != -ECONNABORTED)
+                        {
+                            /* Anything but a passing shortage or a connection gone before it was accepted would
+                                fail again straight away, so hand it to the caller and stop accepting */
+                            op.on_accept(*this, std::unexpected(std::error_code(-cqe.res, std::system_category())));
+                            return false;
+                        }
+                        /* The kernel drops a multishot accept on error or overflow, so arm it again */
+                        if (!more && !op.cancelled)
+                        {
+                            queue_accept(id, op.tcp->fd());
+                        }
+                        return true;
+
+                    case RECV:
+                        if (cqe.res == -ENOBUFS)
+                        {
+                            /* Every provided buffer is in use, rearm and let the handlers catch up */
+                            if (!more)
+                            {
+                                queue_recv(id, op.tcp->fd());
+                            }
+                            return true;
+                        }
+                        if (cqe.res > 0)
+                        {
+                            assert_throw(cqe.flags & IORING_CQE_F_BUFFER, "Receive completed without a buffer");
+                            unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                            const std::byte *data = buffers + static_cast<std::size_t>(bid) * buffer_len;
+                            try
+                            {
+                                op.on_recv(*this, *op.tcp, std::span<const std::byte>(data, cqe.res), {});
+                            }
+                            catch (...)
+                            {
+                                recycle_buffer(bid);
+                                throw;
+                            }
+                            recycle_buffer(bid);
+                            if (!more && !op.cancelled)
+                            {
+                                queue_recv(id, op.tcp->fd());
+                            }
+                            return true;
+                        }
+                        /* A failure on one connection is that connection's problem, not the whole loop's */
+                        op.on_recv(*this, *op.tcp, std::span<const std::byte>(),
+                                   cqe.res < 0 ? std::error_code(-cqe.res, std::system_category()) : std::error_code());
+                        return false;
+
+                    case SEND:
+                        if (cqe.res > 0 && op.send_done + cqe.res < op.send_len)
+                        {
+                            /* Short send, queue the rest instead of reporting a partial write */
+                            op.send_done += cqe.res;
+                            queue_send(id, op);
+                            return true;
+                        }
+                        op.on_send(*this, *op.tcp, cqe.res < 0 ? cqe.res : op.send_done + cqe.res);
+                        return false;
+                }
+                return false;
+            }
+
+            auto release() -> void
+            {
+                if (buffers != MAP_FAILED)
+                {
+                    munmap(buffers, buffers_size);
+                }
+                if (buf_ring != MAP_FAILED)
+                {
+                    munmap(buf_ring, buf_ring_size);
+                }
+                if (sqes != MAP_FAILED)
+                {
+                    munmap(sqes, sqes_size);
+                }
+                if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+                {
+                    munmap(cq_ptr, cq_size);
+                }
+                if (sq_ptr != MAP_FAILED)
+                {
+                    munmap(sq_ptr, sq_size);
+                }
+                if (wake_fd != -1)
+                {
+                    close(wake_fd);
+                }
+                close(ring_fd);
+            }
+
+        public:
+            /*  Create a new ring with room for entries queued operations. buffer_count buffers of buffer_len
+                bytes are provided to multishot receives, buffer_count must be a power of two */
+            explicit Uring(const unsigned entries = 1024, const unsigned buffer_count = 1024,
+                           const unsigned buffer_len = 4096)
+                : buffer_count(buffer_count), buffer_len(buffer_len)
+            {
+                assert_throw(buffer_count != 0 && (buffer_count & (buffer_count - 1)) == 0,
+                             "Buffer count must be a power of two");
+
+                struct io_uring_params params = {};
+                params.flags = IORING_SETUP_CQSIZE;
+                params.cq_entries = entries * 4;
+                ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+                assert_throw(ring_fd != -1, "Failed to create io_uring");
+
+                sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+                if (params.features & IORING_FEAT_SINGLE_MMAP)
+                {
+                    sq_size = cq_size = std::max(sq_size, cq_size);
+                }
+
+                sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                              IORING_OFF_SQ_RING);
+                if (sq_ptr != MAP_FAILED)
+                {
+                    cq_ptr = params.features & IORING_FEAT_SINGLE_MMAP
+                                 ? sq_ptr
+                                 : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                        ring_fd, IORING_OFF_CQ_RING);
+                }
+                sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+                if (cq_ptr != MAP_FAILED)
+                {
+                    sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                                                   MAP_SHARED | MAP_POPULATE, ring_fd,
+                                                                   IORING_OFF_SQES));
+                }
+                if (sqes == MAP_FAILED)
+                {
+                    release();
+                    assert_throw(false, "Failed to map io_uring");
+                }
+
+                auto *sq = static_cast<std::byte *>(sq_ptr);
+                sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+                sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+                sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+                sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+                sq_entries = params.sq_entries;
+                sq_local_tail = *sq_tail;
+
+                auto *cq = static_cast<std::byte *>(cq_ptr);
+                cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+                cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+                cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+                cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+                /* Provided buffer ring shared with the kernel, plus the memory the buffers point into */
+                buf_ring_size = buffer_count * sizeof(struct io_uring_buf);
+                buf_ring = static_cast<struct io_uring_buf_ring *>(
+                    mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+                buffers_size = static_cast<std::size_t>(buffer_count) * buffer_len;
+                if (buf_ring != MAP_FAILED)
+                {
+                    buffers = static_cast<std::byte *>(
+                        mmap(nullptr, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+                }
+                if (buffers == MAP_FAILED)
+                {
+                    release();
+                    assert_throw(false, "Failed to allocate receive buffers");
+                }
+
+                struct io_uring_buf_reg reg = {};
+                reg.ring_addr = reinterpret_cast<std::uint64_t>(buf_ring);
+                reg.ring_entries = buffer_count;
+                reg.bgid = BUFFER_GROUP;
+                int ret = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+                if (ret == -1)
+                {
+                    release();
+                    assert_throw(false, "Failed to register receive buffers");
+                }
+
+                buf_ring->tail = 0;
+                for (unsigned bid = 0; bid < buffer_count; ++bid)
+                {
+                    recycle_buffer(bid);
+                }
+
+                wake_fd = eventfd(0, EFD_CLOEXEC);
+                if (wake_fd == -1)
+                {
+                    release();
+                    assert_throw(false, "Failed to create wakeup eventfd");
+                }
+                queue_wake();
+            }
+
+            /* Tears down the ring, any operations still in flight are cancelled by the kernel */
+            ~Uring()
+            {
+                release();
+            }
+
+            /* Uring should not be copied, since this is undefined behavior */
+            Uring(const Uring &obj) = delete;
+
+            /* Uring should not be copied, since this is undefined behavior */
+            auto operator=(const Uring &obj) -> Uring & = delete;
+
+            /*  Calls handler with every connection accepted by listener until the ring is destroyed or accepting
+                fails for good, which is reported once with the error */
+            auto accept_multishot(TCP &listener, AcceptHandler handler) -> void
+            {
+                assert_throw(listener.get_side() == TCP::Side::SERVER, "Must accept connection from server");
+                std::uint64_t id = next_id++;
+                ops.emplace(id, Op{ACCEPT, &listener, std::move(handler), {}, {}, nullptr, 0, 0, false});
+                queue_accept(id, listener.fd());
+            }
+
+            /*  Calls handler with every chunk received on tcp until the peer closes the connection, which is
+                reported once with an empty chunk */
+            auto recv_multishot(TCP &tcp, RecvHandler handler) -> void
+            {
+                assert_throw(tcp.get_side() != TCP::Side::SERVER, "Can not read from server socket");
+                std::uint64_t id = next_id++;
+                ops.emplace(id, Op{RECV, &tcp, {}, std::move(handler), {}, nullptr, 0, 0, false});
+                queue_recv(id, tcp.fd());
+            }
+
+            /*  Sends all size bytes of msg and calls handler when done, short sends are continued internally.
+                msg must stay alive until the handler runs */
+            auto send(TCP &tcp, const void *msg, const std::size_t size, SendHandler handler) -> void
+            {
+                assert_throw(tcp.get_side() != TCP::Side::SERVER, "Can not write to server socket");
+                std::uint64_t id = next_id++;
+                const std::byte *buf = static_cast<const std::byte *>(msg);
+                auto [it, inserted] = ops.emplace(id, Op{SEND, &tcp, {}, {}, std::move(handler), buf, size, 0, false});
+                queue_send(id, it->second);
+            }
+
+            /*  Cancels every operation queued on tcp, call this before destroying a socket whose peer has not
+                closed it yet. The handlers of cancelled operations are not called again, it is safe to call
+                from inside one of them */
+            auto cancel(TCP &tcp) -> void
+            {
+                for (auto &[id, op] : ops)
+                {
+                    if (op.tcp == &tcp && !op.cancelled)
+                    {
+                        op.cancelled = true;
+                        graveyard.push_back(id);
+                    }
+                }
+                if (!dispatching)
+                {
+                    bury();
+                }
+
+                struct io_uring_sqe *sqe = next_sqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = tcp.fd();
+                sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+                sqe->user_data = 0;
+                submit();
+            }
+
+            /* Hands every queued operation to the kernel in one call, returns the number submitted */
+            auto submit() -> unsigned
+            {
+                store_release(sq_tail, sq_local_tail);
+                if (to_submit == 0)
+                {
+                    return 0;
+                }
+
+                int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+                assert_throw(ret != -1 || errno == EINTR || errno == EBUSY, "Failed to submit to io_uring");
+                unsigned submitted = ret == -1 ? 0 : ret;
+                to_submit -= submitted;
+                return submitted;
+            }
+
+            /*  Submits queued operations, waits for at least one completion when wait is set and runs the
+                handlers of every completion available. Returns the number of completions handled */
+            auto poll(const bool wait = true) -> std::size_t
+            {
+                store_release(sq_tail, sq_local_tail);
+                unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+                if (to_submit != 0 || wait)
+                {
+                    int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait ? 1 : 0, flags, nullptr, 0);
+                    assert_throw(ret != -1 || errno == EINTR || errno == EBUSY, "Failed to submit to io_uring");
+                    to_submit -= ret == -1 ? 0 : ret;
+                }
+
+                std::size_t handled = 0;
+                unsigned head = *cq_head;
+                dispatching = true;
+                try
+                {
+                    while (head != load_acquire(cq_tail))
+                    {
+                        struct io_uring_cqe cqe = cqes[head & *cq_mask];
+                        store_release(cq_head, ++head);
+                        ++handled;
+
+                        if (cqe.user_data == WAKE)
+                        {
+                            queue_wake();
+                            continue;
+                        }
+
+                        auto it = ops.find(cqe.user_data);
+                        if (it == ops.end() || it->second.cancelled)
+                        {
+                            /* Late completion of a cancelled receive, the buffer still has to go back */
+                            if (cqe.flags & IORING_CQE_F_BUFFER)
+                            {
+                                recycle_buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                            }
+                            continue;
+                        }
+                        if (!complete(cqe.user_data, it->second, cqe))
+                        {
+                            ops.erase(cqe.user_data);
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    dispatching = false;
+                    bury();
+                    throw;
+                }
+                dispatching = false;
+
+                bury();
+                return handled;
+            }
+
+            /* Handles completions until stop is called */
+            auto run() -> void
+            {
+                while (!stopping.exchange(false))
+                {
+                    poll(true);
+                }
+            }
+
+            /* Makes run return after the current batch of completions, can be called from any thread */
+            auto stop() -> void
+            {
+                stopping = true;
+                std::uint64_t one = 1;
+                [[maybe_unused]] ssize_t ret = ::write(wake_fd, &one, sizeof(one));
+            }
+    };
+} // namespace jj
+
+#endif